@@ -7,6 +7,13 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include <render/shader.h>
+#include <render/culling.h>
+#include <render/parallel.h>
+#include <render/batch_math.h>
+#include <render/mesh_optimize.h>
+#include <render/render_queue.h>
+#include <render/radix_sort.h>
+#include <render/geometry_arena.h>
 
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
@@ -14,13 +21,20 @@
 #include <tiny_gltf.h>
 
 #include <vector>
-#include <map>
+#include <string>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <cmath>
 #include <cassert>
 #include <cstring>
+#include <climits>
+#include <cfloat>
+#include <cstddef>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <functional>
 
 #define BUFFER_OFFSET(i) ((char*)NULL + (i))
 
@@ -45,16 +59,141 @@ static float pitch = 0.0f;
 static GLuint gShadowFBO = 0;
 static GLuint gShadowTex = 0;
 static const int SHADOW_RES = 2048;
+
+// Animated casters (bots) go to a separate, smaller layer so the static cloud layer
+// above can be kept across frames; bot.frag takes the darker of the two.
+static GLuint gShadowDynFBO = 0;
+static GLuint gShadowDynTex = 0;
+static const int SHADOW_DYN_RES = 1024;
+
+// Cascaded shadow maps: the view range up to FOG_END is split into slices, each with
+// its own tightly fitted light matrix and depth target. Splits blend between uniform
+// (lambda = 0) and logarithmic (lambda = 1) spacing. Far cascades may be refreshed
+// every N frames only. The count is set with --cascades or cycled with J at runtime.
+static const int MAX_CASCADES = 4;
+static int gCascadeCount = 3;
+static float gCascadeSplitLambda = 0.75f;
+static const int CASCADE_RES[MAX_CASCADES] = { 1024, 1024, 512, 512 };
+static const int CASCADE_UPDATE_INTERVAL[MAX_CASCADES] = { 1, 1, 2, 4 };
+static const float CASCADE_CASTER_MARGIN = 2000.0f;
+
+struct ShadowCascade {
+    GLuint fbo = 0, tex = 0;
+    int res = 0;
+    float splitFar = 0.0f;
+    glm::mat4 lightVP = glm::mat4(1.0f);
+    float depthBias = 0.0f;     // one texel's world size in this cascade's depth units
+    bool valid = false;
+    bool refresh = false;       // refit this frame (fitCascades), so redraw it
+};
+static ShadowCascade gCascades[MAX_CASCADES];
+static unsigned long gFrameIndex = 0;
 static glm::mat4 gLightVP(1.0f);
 
+// Constants every program reads the same way for a whole frame, in one std140 uniform
+// buffer written once per frame (uploadFrameUniforms) and bound at a fixed binding point.
+// Mirrors the FrameUniforms block in the shaders: vec3 members share their 16 bytes with
+// the scalar after them, as in std140.
+struct FrameUniforms {
+    glm::mat4 viewProj;
+    glm::mat4 skyViewProj;      // view without its translation
+    glm::mat4 lightVP;          // single shadow map
+    glm::mat4 cascadeVP[MAX_CASCADES];
+    glm::vec4 cascadeSplits;    // far view distance of each cascade
+    glm::vec4 cascadeBias;      // depth bias of each cascade, scaled by its texel size
+    glm::vec3 cameraPosition;
+    float fogStart;
+    glm::vec3 fogColor;
+    float fogEnd;
+    glm::vec3 lightPosition;
+    GLint shadowMode;           // 0: single map (+ dynamic layer), 1: cascaded
+    glm::vec3 lightIntensity;
+    GLint cascadeCount;
+    glm::vec3 viewForward;
+    GLint weightedOIT;
+};
+static_assert(sizeof(FrameUniforms) == 560, "FrameUniforms must match the std140 layout of the shader block");
+
+static const GLuint FRAME_UNIFORMS_BINDING = 0;
+static GLuint gFrameUBO = 0;
+
+// The one GLSL copy of the block, passed as the header of CompileShader() for the shaders
+// built from strings here and of LoadShadersFromFile() for the shader files.
+static const char* FRAME_UNIFORMS_GLSL = R"GLSL(
+        layout(std140) uniform FrameUniforms {
+            mat4 uViewProj;
+            mat4 uSkyViewProj;
+            mat4 uLightVP;
+            mat4 uCascadeVP[4];
+            vec4 uCascadeSplits;
+            vec4 uCascadeBias;
+            vec3 cameraPosition;
+            float fogStart;
+            vec3 fogColor;
+            float fogEnd;
+            vec3 lightPosition;
+            int uShadowMode;
+            vec3 lightIntensity;
+            int uCascadeCount;
+            vec3 uViewForward;
+            bool uWeightedOIT;
+        };
+)GLSL";
+
+static void initFrameUniforms() {
+    glGenBuffers(1, &gFrameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, gFrameUBO);
+}
+
+// Re-specifying the whole store orphans the copy the previous frame's draws still read.
+static void uploadFrameUniforms(const FrameUniforms& frame) {
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), &frame, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Points the program's FrameUniforms block, if it has one, at the shared buffer.
+static void bindFrameUniforms(GLuint program) {
+    GLuint block = glGetUniformBlockIndex(program, "FrameUniforms");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, FRAME_UNIFORMS_BINDING);
+}
+
 static GLuint gCloudDepthProg = 0;
 static GLuint gBotDepthProg = 0;
-static GLint gCloudDepth_uLightVP = -1, gCloudDepth_uModel = -1;
-static GLint gBotDepth_uLightVP = -1, gBotDepth_uModel = -1, gBotDepth_uJoints = -1;
-
-static GLuint CompileShader(GLenum type, const char* src) {
+static GLint gCloudDepth_uLightIndex = -1, gCloudDepth_uModel = -1;
+static GLint gBotDepth_uLightIndex = -1, gBotDepth_uModel = -1, gBotDepth_uJoints = -1;
+static GLint gBotDepth_uPreSkinned = -1;
+static GLint gBotDepth_uInstanced = -1, gBotDepth_uPalettes = -1;
+static GLint gBotDepth_uBaked = -1, gBotDepth_uBakedFrameCount = -1, gBotDepth_uBakedFPS = -1;
+
+static GLuint gCloudDepthInstProg = 0;
+static GLint gCloudDepthInst_uLightIndex = -1;
+
+// All per-frame draws bind programs, vertex arrays and textures and toggle blending,
+// culling and depth writes through gGL. Each pass collects its draws in gRenderQueue
+// and submits them sorted, so draws sharing a program and textures run back to back.
+static GLStateCache gGL;
+static RenderQueue gRenderQueue;
+
+// Static meshes of every loader live in gGeometry, one vertex buffer per shared vertex
+// format below (registered by initGeometry) and one index buffer.
+static GeometryArena gGeometry;
+static int gFormatPosition = -1;        // vec3 position: skybox
+static int gFormatPackedMesh = -1;      // Cloud::PackedVertex
+static int gFormatSkinned = -1;         // MyBot::SkinnedVertex
+static const unsigned PASS_DEPTH = 0;
+static const unsigned PASS_COLOR = 1;
+
+// header, if given, goes after the #version line (InsertAfterVersion).
+static GLuint CompileShader(GLenum type, const char* src, const char* header = nullptr) {
+    std::string code(src);
+    if (header) InsertAfterVersion(code, header);
+    const char* source = code.c_str();
     GLuint s = glCreateShader(type);
-    glShaderSource(s, 1, &src, nullptr);
+    glShaderSource(s, 1, &source, nullptr);
     glCompileShader(s);
     GLint ok = 0;
     glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
@@ -87,13 +226,13 @@ static GLuint LinkProgram(GLuint vs, GLuint fs) {
     return p;
 }
 
-static void initShadowMap() {
-    glGenFramebuffers(1, &gShadowFBO);
+static void createDepthTarget(int res, GLuint& fbo, GLuint& tex) {
+    glGenFramebuffers(1, &fbo);
 
-    glGenTextures(1, &gShadowTex);
-    glBindTexture(GL_TEXTURE_2D, gShadowTex);
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24,
-        SHADOW_RES, SHADOW_RES, 0,
+        res, res, 0,
         GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -104,8 +243,8 @@ static void initShadowMap() {
     float border[4] = { 1,1,1,1 };
     glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, gShadowFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gShadowTex, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex, 0);
 
     glDrawBuffer(GL_NONE);
     glReadBuffer(GL_NONE);
@@ -116,19 +255,43 @@ static void initShadowMap() {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+static void initShadowMap() {
+    createDepthTarget(SHADOW_RES, gShadowFBO, gShadowTex);
+    createDepthTarget(SHADOW_DYN_RES, gShadowDynFBO, gShadowDynTex);
+
+    for (int i = 0; i < MAX_CASCADES; ++i) {
+        gCascades[i].res = CASCADE_RES[i];
+        createDepthTarget(gCascades[i].res, gCascades[i].fbo, gCascades[i].tex);
+    }
+}
+
 static void initDepthPrograms() {
     const char* depthFS = R"GLSL(
         #version 330 core
         void main() { }
     )GLSL";
 
+    // uLightIndex picks the light matrix out of the frame uniforms: -1 for the single
+    // shadow map, else the cascade
     const char* cloudVS = R"GLSL(
         #version 330 core
         layout(location=0) in vec3 aPos;
-        uniform mat4 uLightVP;
+        uniform int uLightIndex;
         uniform mat4 uModel;
         void main() {
-            gl_Position = uLightVP * uModel * vec4(aPos, 1.0);
+            mat4 lightVP = uLightIndex < 0 ? uLightVP : uCascadeVP[uLightIndex];
+            gl_Position = lightVP * uModel * vec4(aPos, 1.0);
+        }
+    )GLSL";
+
+    const char* cloudInstVS = R"GLSL(
+        #version 330 core
+        layout(location=0) in vec3 aPos;
+        layout(location=3) in mat4 iModel;
+        uniform int uLightIndex;
+        void main() {
+            mat4 lightVP = uLightIndex < 0 ? uLightVP : uCascadeVP[uLightIndex];
+            gl_Position = lightVP * iModel * vec4(aPos, 1.0);
         }
     )GLSL";
 
@@ -137,38 +300,94 @@ static void initDepthPrograms() {
         layout(location=0) in vec3 vertexPosition;
         layout(location=3) in vec4 vertexJointsFloat;
         layout(location=4) in vec4 vertexWeights;
+        layout(location=5) in mat4 iModel;
+        layout(location=9) in int iPaletteBase;
+        layout(location=10) in float iAnimTime;
 
-        uniform mat4 uLightVP;
+        uniform int uLightIndex;
         uniform mat4 uModel;
         uniform mat4 jointMatrices[100];
+        uniform bool uPreSkinned;
+        uniform bool uInstanced;
+        uniform samplerBuffer uPalettes;
+
+        uniform bool uBaked;
+        uniform sampler2D uBakedPalettes;
+        uniform int uBakedFrameCount;
+        uniform float uBakedFPS;
+
+        int bakedFrame0, bakedFrame1;
+        float bakedAlpha;
+
+        mat4 bakedJoint(int frame, uint j) {
+            int x = int(j) * 3;
+            return transpose(mat4(texelFetch(uBakedPalettes, ivec2(x, frame), 0),
+                texelFetch(uBakedPalettes, ivec2(x + 1, frame), 0),
+                texelFetch(uBakedPalettes, ivec2(x + 2, frame), 0),
+                vec4(0.0, 0.0, 0.0, 1.0)));
+        }
+
+        mat4 jointMatrix(uint j) {
+            if (uBaked) return mix(bakedJoint(bakedFrame0, j), bakedJoint(bakedFrame1, j), bakedAlpha);
+            if (!uInstanced) return jointMatrices[j];
+            int base = (iPaletteBase + int(j)) * 4;
+            return mat4(texelFetch(uPalettes, base), texelFetch(uPalettes, base + 1),
+                texelFetch(uPalettes, base + 2), texelFetch(uPalettes, base + 3));
+        }
 
         void main() {
+            if (uBaked) {
+                float frame = mod(iAnimTime * uBakedFPS, float(uBakedFrameCount));
+                bakedFrame0 = int(frame);
+                bakedFrame1 = (bakedFrame0 + 1) % uBakedFrameCount;
+                bakedAlpha = fract(frame);
+            }
+
             uvec4 j = uvec4(vertexJointsFloat);
-            mat4 skinMat =
-                vertexWeights.x * jointMatrices[j.x] +
-                vertexWeights.y * jointMatrices[j.y] +
-                vertexWeights.z * jointMatrices[j.z] +
-                vertexWeights.w * jointMatrices[j.w];
+            mat4 skinMat = uPreSkinned ? mat4(1.0) :
+                vertexWeights.x * jointMatrix(j.x) +
+                vertexWeights.y * jointMatrix(j.y) +
+                vertexWeights.z * jointMatrix(j.z) +
+                vertexWeights.w * jointMatrix(j.w);
 
             vec4 skinnedLocal = skinMat * vec4(vertexPosition, 1.0);
-            vec4 worldPos = uModel * skinnedLocal;
-            gl_Position = uLightVP * worldPos;
+            vec4 worldPos = (uInstanced ? iModel : uModel) * skinnedLocal;
+            mat4 lightVP = uLightIndex < 0 ? uLightVP : uCascadeVP[uLightIndex];
+            gl_Position = lightVP * worldPos;
         }
     )GLSL";
 
     GLuint fs = CompileShader(GL_FRAGMENT_SHADER, depthFS);
 
-    GLuint cvs = CompileShader(GL_VERTEX_SHADER, cloudVS);
+    GLuint cvs = CompileShader(GL_VERTEX_SHADER, cloudVS, FRAME_UNIFORMS_GLSL);
     gCloudDepthProg = LinkProgram(cvs, fs);
-    gCloudDepth_uLightVP = glGetUniformLocation(gCloudDepthProg, "uLightVP");
+    bindFrameUniforms(gCloudDepthProg);
+    gCloudDepth_uLightIndex = glGetUniformLocation(gCloudDepthProg, "uLightIndex");
     gCloudDepth_uModel = glGetUniformLocation(gCloudDepthProg, "uModel");
 
+    GLuint cifs = CompileShader(GL_FRAGMENT_SHADER, depthFS);
+    GLuint civs = CompileShader(GL_VERTEX_SHADER, cloudInstVS, FRAME_UNIFORMS_GLSL);
+    gCloudDepthInstProg = LinkProgram(civs, cifs);
+    bindFrameUniforms(gCloudDepthInstProg);
+    gCloudDepthInst_uLightIndex = glGetUniformLocation(gCloudDepthInstProg, "uLightIndex");
+
     GLuint bfs = CompileShader(GL_FRAGMENT_SHADER, depthFS); 
-    GLuint bvs = CompileShader(GL_VERTEX_SHADER, botVS);
+    GLuint bvs = CompileShader(GL_VERTEX_SHADER, botVS, FRAME_UNIFORMS_GLSL);
     gBotDepthProg = LinkProgram(bvs, bfs);
-    gBotDepth_uLightVP = glGetUniformLocation(gBotDepthProg, "uLightVP");
+    bindFrameUniforms(gBotDepthProg);
+    gBotDepth_uLightIndex = glGetUniformLocation(gBotDepthProg, "uLightIndex");
     gBotDepth_uModel = glGetUniformLocation(gBotDepthProg, "uModel");
     gBotDepth_uJoints = glGetUniformLocation(gBotDepthProg, "jointMatrices");
+    gBotDepth_uPreSkinned = glGetUniformLocation(gBotDepthProg, "uPreSkinned");
+    gBotDepth_uInstanced = glGetUniformLocation(gBotDepthProg, "uInstanced");
+    gBotDepth_uPalettes = glGetUniformLocation(gBotDepthProg, "uPalettes");
+    gBotDepth_uBaked = glGetUniformLocation(gBotDepthProg, "uBaked");
+    gBotDepth_uBakedFrameCount = glGetUniformLocation(gBotDepthProg, "uBakedFrameCount");
+    gBotDepth_uBakedFPS = glGetUniformLocation(gBotDepthProg, "uBakedFPS");
+    glUseProgram(gBotDepthProg);
+    glUniform1i(gBotDepth_uPalettes, 13);
+    glUniform1i(glGetUniformLocation(gBotDepthProg, "uBakedPalettes"), 14);
+    glUseProgram(0);
 }
 
 static void updateCamera(float dt) {
@@ -200,9 +419,79 @@ static void updateCamera(float dt) {
 static glm::vec3 lightIntensity(5e6f, 5e6f, 5e6f);
 static glm::vec3 lightPosition(-275.0f, 500.0f, 800.0f);
 
+static const glm::vec3 FOG_COLOR(0.6f, 0.7f, 0.85f);
+static const float FOG_START = 1200.0f;
+static const float FOG_END = 6000.0f;
+
 static bool playAnimation = true;
 static float playbackSpeed = 2.0f;
 
+// Draw the whole cloud field with one instanced call per pass (toggle: I).
+static bool useCloudInstancing = true;
+// Skip clouds and bots outside the view frustum or past FOG_END (toggle: C).
+static bool useFrustumCulling = true;
+// Keep the cloud shadow layer until the tile window moves (toggle: H).
+static bool useShadowCache = true;
+// Cascaded shadow maps instead of the single field-wide map (toggle: K).
+static bool useCascadedShadows = false;
+// Skin the shared bot pose once per frame with transform feedback (toggle: P).
+static bool usePreSkinning = true;
+// Give every bot its own animation time and draw them all with one instanced call,
+// palettes built on worker threads (toggle: B). Overrides pre-skinning.
+static bool useBotInstancing = true;
+// Instanced bots fetch their palettes from the baked animation texture instead of
+// palettes evaluated on the CPU each frame (toggle: N).
+static bool useBakedAnimation = false;
+// Update far bots' poses less often: every BOT_ANIM_LOD_INTERVAL frames by distance,
+// frozen (0) past the last threshold (toggle: L).
+static bool useAnimationLod = true;
+static const int BOT_ANIM_LODS = 4;
+static const float BOT_ANIM_LOD_DISTANCE[BOT_ANIM_LODS - 1] = { 1500.0f, 3000.0f, 4500.0f };
+static const int BOT_ANIM_LOD_INTERVAL[BOT_ANIM_LODS] = { 1, 2, 4, 0 };
+// ensurePalettes uploads each run of changed palettes separately up to this many runs
+static const size_t PALETTE_MAX_UPLOAD_RUNS = 16;
+// Compress the bot's animation at load time: drop keys that interpolation reproduces
+// within these tolerances, quantize the rest to 16 bits per component.
+static bool useAnimationCompression = true;
+static const float ANIM_TOLERANCE_TRANSLATION = 0.05f;  // model units
+static const float ANIM_TOLERANCE_ROTATION = 0.002f;    // radians
+static const float ANIM_TOLERANCE_SCALE = 0.0005f;
+// Draw cloud tiles with simplified meshes, each tile at the coarsest level whose
+// simplification error projects to at most CLOUD_LOD_PIXEL_ERROR pixels; shadow passes
+// use the next coarser level, the last one being a shadow-only level (toggle: M).
+static bool useCloudLod = true;
+static const int CLOUD_LODS = 4;
+static const float CLOUD_LOD_RATIO[CLOUD_LODS] = { 1.0f, 0.35f, 0.12f, 0.04f };   // of the full triangle count
+static const float CLOUD_SHADOW_LOD_RATIO = 0.015f;
+static const float CLOUD_LOD_MAX_ERROR = 0.02f;           // per level, fraction of the mesh radius
+static const float CLOUD_SHADOW_LOD_MAX_ERROR = 0.06f;
+static const float CLOUD_LOD_PIXEL_ERROR = 2.0f;
+// A tile moves to a coarser level once that level is this much under the limit, and
+// back once its own level is this much over it.
+static const float CLOUD_LOD_HYSTERESIS = 0.25f;
+// Past CLOUD_IMPOSTOR_DISTANCE draw cloud tiles as camera-facing quads textured from an
+// octahedral atlas of the mesh baked at startup (toggle: O). Shadows keep the meshes.
+static bool useCloudImpostors = true;
+static const float CLOUD_IMPOSTOR_DISTANCE = 3500.0f;
+static const float CLOUD_IMPOSTOR_HYSTERESIS = 0.05f;
+static const int CLOUD_IMPOSTOR_FRAMES = 8;         // views per atlas side
+static const int CLOUD_IMPOSTOR_FRAME_RES = 128;
+// Skip bots hidden behind clouds (toggle: V). Each frame the visible cloud meshes are
+// drawn depth-only where their texture is at least CLOUD_OCCLUDER_ALPHA opaque, and an
+// occlusion query tests each bot's bounding box against that. Instanced bots use the
+// query results of earlier frames, as soon as the GPU has them; single bots are drawn
+// under conditional rendering on the current frame's query.
+static bool useOcclusionCulling = true;
+static const float CLOUD_OCCLUDER_ALPHA = 0.98f;
+// Draw the instanced clouds and impostors back to front by view depth and the instanced
+// bots front to back, both ordered with a radix sort (toggle: T). Without it instances
+// go in tile order.
+static bool useDepthSorting = true;
+// Composite the clouds with weighted blended order-independent transparency (McGuire and
+// Bavoil 2013) instead of sorting them (toggle: U).
+static bool useWeightedOIT = false;
+static float gAnimTime = 0.0f;
+
 static const char* SKY_PX_PATH = "../final_project/final_project/skybox/right.png";
 static const char* SKY_NX_PATH = "../final_project/final_project/skybox/left.png";
 static const char* SKY_PY_PATH = "../final_project/final_project/skybox/top.png";
@@ -222,6 +511,9 @@ static const char* SKYBOX_FRAG_PATH =
 static const char* CLOUD_GLTF_PATH = "../final_project/final_project/cloud/scene.gltf";
 static const char* CLOUD_VERT_PATH = "../final_project/final_project/shader/cloud.vert";
 static const char* CLOUD_FRAG_PATH = "../final_project/final_project/shader/cloud.frag";
+static const char* CLOUD_INSTANCED_VERT_PATH = "../final_project/final_project/shader/cloud_instanced.vert";
+static const char* CLOUD_IMPOSTOR_VERT_PATH = "../final_project/final_project/shader/cloud_impostor.vert";
+static const char* CLOUD_IMPOSTOR_FRAG_PATH = "../final_project/final_project/shader/cloud_impostor.frag";
 static const char* CLOUD_COLOR_PATH = "../final_project/final_project/cloud/textures/Cloud_baseColor.png";
 static const char* CLOUD_NORMAL_PATH = "../final_project/final_project/cloud/textures/Cloud_normal.png";
 
@@ -236,20 +528,87 @@ static const float CLOUD_LAYER_BLEND = 70.0f;
 static const float CLOUD_Y_JITTER = 120.0f;   
 static const float BOT_Y_OFFSET = 0.0f;    
 static const int CLOUD_RADIUS = 5; 
+// Tiles out from the camera tile in each direction; starts at CLOUD_RADIUS, set with
+// --cloud-radius N or the -/= keys.
+static int gCloudRadius = CLOUD_RADIUS;
+static const int CLOUD_RADIUS_MAX = 200;
+// The window is split into blocks of CLOUD_BLOCK_SIZE^2 tiles with one bounding sphere
+// each, so whole blocks are culled or switched to impostors with one test.
+static const int CLOUD_BLOCK_SIZE = 8;
+// The single shadow map never needs to reach past the fog.
+static const int CLOUD_SHADOW_RADIUS = 5;
 static const float BOT_SPAWN_CHANCE = 0.7f;
 
-static glm::mat4 computeLightVP() {
-    glm::vec3 center = eye_center;
+// With snapToTexels the projection is shifted so world space maps onto whole shadow
+// texels; together with a tile-aligned center this makes the matrix (and therefore the
+// cached static layer) change only when the tile window moves.
+static glm::mat4 computeLightVP(const glm::vec3& center, bool snapToTexels) {
     glm::vec3 lightDir = glm::normalize(center - lightPosition);
     glm::vec3 lightPos = center - lightDir * 2000.0f;
 
     glm::mat4 lightView = glm::lookAt(lightPos, center, glm::vec3(0, 1, 0));
 
-    float r = CLOUD_SPACING * (CLOUD_RADIUS + 1);
+    float r = CLOUD_SPACING * (glm::min(gCloudRadius, CLOUD_SHADOW_RADIUS) + 1);
     float nearP = 0.1f;
     float farP = 7000.0f;
 
     glm::mat4 lightProj = glm::ortho(-r, r, -r, r, nearP, farP);
+
+    if (snapToTexels) {
+        glm::vec4 origin = lightProj * lightView * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        float halfRes = SHADOW_RES * 0.5f;
+        glm::vec2 texel = glm::vec2(origin) * halfRes;
+        glm::vec2 offset = (glm::round(texel) - texel) / halfRes;
+        lightProj[3][0] += offset.x;
+        lightProj[3][1] += offset.y;
+    }
+    return lightProj * lightView;
+}
+
+static float cascadeSplitDistance(int i, int count, float nearP, float farP) {
+    float p = float(i) / float(count);
+    float logSplit = nearP * powf(farP / nearP, p);
+    float uniformSplit = nearP + (farP - nearP) * p;
+    return gCascadeSplitLambda * logSplit + (1.0f - gCascadeSplitLambda) * uniformSplit;
+}
+
+// Fits an ortho light matrix around the bounding sphere of the view-frustum slice
+// [sliceNear, sliceFar]. The sphere keeps the extent constant under camera rotation
+// and the center is snapped to whole texels, so shadows do not shimmer.
+// texelDepth receives the world size of one shadow texel in the matrix's depth units.
+static glm::mat4 computeCascadeLightVP(const glm::mat4& invView, float aspect, float sliceNear, float sliceFar,
+    const glm::vec3& lightDir, int res, float& texelDepth) {
+    float tanY = tanf(glm::radians(FoV) * 0.5f);
+    float tanX = tanY * aspect;
+
+    glm::vec3 corners[8];
+    int k = 0;
+    for (int s = 0; s < 2; ++s) {
+        float d = (s == 0) ? sliceNear : sliceFar;
+        for (int y = -1; y <= 1; y += 2)
+            for (int x = -1; x <= 1; x += 2)
+                corners[k++] = glm::vec3(invView * glm::vec4(x * tanX * d, y * tanY * d, -d, 1.0f));
+    }
+
+    glm::vec3 center(0.0f);
+    for (int i = 0; i < 8; ++i) center += corners[i];
+    center /= 8.0f;
+
+    float radius = 0.0f;
+    for (int i = 0; i < 8; ++i) radius = glm::max(radius, glm::length(corners[i] - center));
+    radius = ceilf(radius * 16.0f) / 16.0f;
+
+    glm::mat4 lightView = glm::lookAt(center - lightDir * (radius + CASCADE_CASTER_MARGIN), center, glm::vec3(0, 1, 0));
+    glm::mat4 lightProj = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius + CASCADE_CASTER_MARGIN);
+    texelDepth = (2.0f * radius / res) / (2.0f * radius + CASCADE_CASTER_MARGIN);
+
+    glm::vec4 origin = lightProj * lightView * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    float halfRes = res * 0.5f;
+    glm::vec2 texel = glm::vec2(origin) * halfRes;
+    glm::vec2 offset = (glm::round(texel) - texel) / halfRes;
+    lightProj[3][0] += offset.x;
+    lightProj[3][1] += offset.y;
+
     return lightProj * lightView;
 }
 
@@ -344,11 +703,10 @@ static inline float hashSigned01(uint32_t h) {
 }
 
 struct Skybox {
-    GLuint vao = 0, vboPos = 0, ebo = 0;
+    GLuint vao = 0;
+    MeshRange mesh;
     GLuint program = 0;
     GLuint cubemap = 0;
-    GLint vpLoc = -1;
-    GLint cubeLoc = -1;
 
     float positions[24 * 3] = {
         // Front (+Z)
@@ -388,7 +746,7 @@ struct Skybox {
           -1,-1, 1
     };
 
-    unsigned int indices[36] = {
+    uint32_t indices[36] = {
         0,1,2,  0,2,3,
         4,5,6,  4,6,7,
         8,9,10, 8,10,11,
@@ -399,11 +757,12 @@ struct Skybox {
 
     void initialize() {
 
-        program = LoadShadersFromFile(SKYBOX_VERT_PATH, SKYBOX_FRAG_PATH);
+        program = LoadShadersFromFile(SKYBOX_VERT_PATH, SKYBOX_FRAG_PATH, FRAME_UNIFORMS_GLSL);
         if (program == 0) std::cerr << "Failed to load skybox shaders.\n";
 
-        vpLoc = glGetUniformLocation(program, "uVP");
-        cubeLoc = glGetUniformLocation(program, "uCube");
+        bindFrameUniforms(program);
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "uCube"), 0);
 
         cubemap = LoadCubemap6(
             SKY_PX_PATH, SKY_NX_PATH,
@@ -413,36 +772,20 @@ struct Skybox {
         );
         if (!cubemap) std::cerr << "Cubemap missing.\n";
 
-        glGenVertexArrays(1, &vao);
-        glBindVertexArray(vao);
-
-        glGenBuffers(1, &vboPos);
-        glBindBuffer(GL_ARRAY_BUFFER, vboPos);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-        glGenBuffers(1, &ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-
-        glBindVertexArray(0);
+        vao = gGeometry.createVertexArray(gFormatPosition);
+        mesh = gGeometry.upload(gFormatPosition, positions, 24, indices, 36);
     }
 
-    void render(const glm::mat4& projection, const glm::mat4& viewNoTranslation) {
+    // view-projection comes from uSkyViewProj in the frame uniforms
+    void render() {
         glDepthFunc(GL_LEQUAL);     
-        glUseProgram(program);
-
-        glm::mat4 vp = projection * viewNoTranslation;
-        glUniformMatrix4fv(vpLoc, 1, GL_FALSE, glm::value_ptr(vp));
+        gGL.useProgram(program);
 
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
-        glUniform1i(cubeLoc, 0);
 
-        glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (void*)0);
-        glBindVertexArray(0);
+        gGL.bindVertexArray(vao);
+        glDrawElementsBaseVertex(GL_TRIANGLES, mesh.indexCount, mesh.indexType, BUFFER_OFFSET(mesh.indexOffset), mesh.baseVertex);
 
         glDepthFunc(GL_LESS);
     }
@@ -450,17 +793,15 @@ struct Skybox {
     void cleanup() {
         if (program) glDeleteProgram(program);
         if (cubemap) glDeleteTextures(1, &cubemap);
-        if (vboPos) glDeleteBuffers(1, &vboPos);
-        if (ebo) glDeleteBuffers(1, &ebo);
-        if (vao) glDeleteVertexArrays(1, &vao);
+        gGeometry.release(mesh);
+        if (vao) gGeometry.destroyVertexArray(vao);
     }
 };
 
 struct Cloud {
-    tinygltf::Model model;
-    GLuint vao = 0, vboPos = 0, vboUV = 0, ebo = 0;
+    GLuint vao = 0;
+    MeshRange mesh;         // every level's indices, then the shadow level's
     GLuint program = 0;
-    GLint mvpLoc = -1, colorLoc = -1;
     GLuint colorTex = 0;
     GLuint normalTex = 0;
 
@@ -468,19 +809,59 @@ struct Cloud {
     std::vector<float> uvs;
     std::vector<unsigned int> indices;
 
-    GLuint vboN = 0;
     std::vector<float> normals;
 
+    // GPU vertex, 12 bytes interleaved: position as 16-bit unorm within the mesh AABB,
+    // normal as 8-bit snorm octahedral, UV as half floats. dequantize maps the unorm
+    // position back to mesh space and is folded into every model matrix sent to the GPU.
+    struct PackedVertex {
+        uint16_t position[3];
+        int8_t normal[2];
+        uint16_t uv[2];
+    };
+    glm::mat4 dequantize = glm::mat4(1.0f);
+    std::vector<glm::mat4> instanceScratch;
+
+    // Ranges of indices: CLOUD_LODS levels for drawing, then the shadow-only level, all
+    // indexing the one vertex buffer.
+    struct MeshLod {
+        size_t firstIndex;
+        GLsizei indexCount;
+        float error;        // largest surface deviation from the full mesh, model units
+    };
+    std::vector<MeshLod> lods;
+
+    // Consecutive uploaded instances drawn at one level with one call.
+    struct InstanceRun {
+        uint8_t lod;
+        GLsizei first, count;
+    };
+    std::vector<InstanceRun> instanceRuns;
+
+    // Octahedral impostor atlas: CLOUD_IMPOSTOR_FRAMES^2 orthographic views of the mesh,
+    // premultiplied color in one texture and depth in the other.
+    struct ImpostorInstance {
+        glm::vec4 centerRadius;     // world bound sphere
+        float rotY;
+        float pad[3];
+    };
+    GLuint impostorColorTex = 0, impostorDepthTex = 0;
+    GLuint impostorProgram = 0, impostorVAO = 0, impostorVBO = 0;
+    size_t impostorCapacity = 0;
+
     glm::vec3 localCenter = glm::vec3(0.0f);
     float localTopY = 0.0f;
+    float localRadius = 0.0f;
 
     GLint modelLoc = -1;
-    GLint camPosLoc = -1;
-    GLint fogColorLoc = -1;
-    GLint fogStartLoc = -1;
-    GLint fogEndLoc = -1;
 
+    GLuint instanceVBO = 0;
+    size_t instanceCapacity = 0;
+    GLuint instProgram = 0;
+
+    // Copies what the cloud needs out of the file; the tinygltf model goes away on return.
     bool loadGLTFMesh(const char* gltfPath) {
+        tinygltf::Model model;
         tinygltf::TinyGLTF loader;
         std::string err, warn;
         bool ok = loader.LoadASCIIFromFile(&model, &err, &warn, gltfPath);
@@ -550,130 +931,461 @@ struct Cloud {
         }
         localCenter = 0.5f * (mn + mx);
         localTopY = mx.y; 
+        localRadius = 0.5f * glm::length(mx - mn);
+
+        glm::vec3 extent = glm::max(mx - mn, glm::vec3(1e-6f));
+        dequantize = glm::translate(glm::mat4(1.0f), mn) * glm::scale(glm::mat4(1.0f), extent);
 
+        optimizeMesh();
+        buildLods();
         return true;
     }
 
+    // Triangle order for the post-transform cache and outward-first overdraw, then
+    // vertices renumbered in first-use order so fetches walk the buffer forwards.
+    void optimizeMesh() {
+        size_t vertexCount = positions.size() / 3;
+        VertexCacheStats before = AnalyzeVertexCache(indices, vertexCount);
+        OptimizeTriangleOrder(indices, vertexCount, positions.data());
+        std::vector<uint32_t> remap = OptimizeVertexFetch(indices, vertexCount);
+        RemapVertexAttribute(positions, 3, remap);
+        RemapVertexAttribute(uvs, 2, remap);
+        RemapVertexAttribute(normals, 3, remap);
+        VertexCacheStats after = AnalyzeVertexCache(indices, vertexCount);
+
+        std::cout << "Cloud mesh vertex cache: ACMR " << std::setprecision(3) << before.acmr << " -> " << after.acmr
+            << ", ATVR " << before.atvr << " -> " << after.atvr << "\n" << std::setprecision(6);
+    }
+
+    // Each level simplifies the one before it, so errors add up along the chain.
+    void buildLods() {
+        size_t vertexCount = positions.size() / 3;
+        size_t fullCount = indices.size();
+        lods.assign(1, MeshLod{ 0, (GLsizei)fullCount, 0.0f });
+
+        std::vector<uint32_t> level(indices.begin(), indices.end());
+        float error = 0.0f;
+        for (int l = 1; l <= CLOUD_LODS; ++l) {
+            bool shadow = (l == CLOUD_LODS);
+            float ratio = shadow ? CLOUD_SHADOW_LOD_RATIO : CLOUD_LOD_RATIO[l];
+            float maxError = (shadow ? CLOUD_SHADOW_LOD_MAX_ERROR : CLOUD_LOD_MAX_ERROR) * localRadius;
+            float levelError = 0.0f;
+            level = SimplifyMesh(level, vertexCount, positions.data(), (size_t)(fullCount * ratio) / 3 * 3, maxError, &levelError);
+            OptimizeTriangleOrder(level, vertexCount, positions.data());
+            error += levelError;
+
+            lods.push_back(MeshLod{ indices.size(), (GLsizei)level.size(), error });
+            indices.insert(indices.end(), level.begin(), level.end());
+        }
+
+        std::cout << "Cloud LODs:";
+        for (size_t l = 0; l < lods.size(); ++l)
+            std::cout << (l == (size_t)CLOUD_LODS ? " shadow " : " ") << lods[l].indexCount / 3 << " tris (" << lods[l].error << ")";
+        std::cout << "\n";
+    }
+
+    static glm::vec2 octahedralEncode(glm::vec3 n) {
+        n /= glm::max(fabsf(n.x) + fabsf(n.y) + fabsf(n.z), 1e-20f);
+        glm::vec2 e(n.x, n.y);
+        if (n.z < 0.0f) {
+            e.x = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+            e.y = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        return e;
+    }
+
+    std::vector<PackedVertex> packVertices() const {
+        glm::mat4 toUnit = glm::inverse(dequantize);
+        size_t count = positions.size() / 3;
+        std::vector<PackedVertex> out(count);
+        for (size_t i = 0; i < count; ++i) {
+            PackedVertex& v = out[i];
+            glm::vec3 q = glm::clamp(glm::vec3(toUnit * glm::vec4(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2], 1.0f)),
+                0.0f, 1.0f);
+            for (int c = 0; c < 3; ++c) v.position[c] = (uint16_t)lroundf(q[c] * 65535.0f);
+
+            glm::vec2 n = octahedralEncode(glm::vec3(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]));
+            v.normal[0] = (int8_t)lroundf(glm::clamp(n.x, -1.0f, 1.0f) * 127.0f);
+            v.normal[1] = (int8_t)lroundf(glm::clamp(n.y, -1.0f, 1.0f) * 127.0f);
+
+            glm::uint uv = glm::packHalf2x16(glm::vec2(uvs[i * 2], uvs[i * 2 + 1]));
+            v.uv[0] = (uint16_t)(uv & 0xffffu);
+            v.uv[1] = (uint16_t)(uv >> 16);
+        }
+        return out;
+    }
+
     void initialize() {
         if (!loadGLTFMesh(CLOUD_GLTF_PATH)) return;
 
         colorTex = LoadTexture2D(CLOUD_COLOR_PATH, true, true);  
         normalTex = LoadTexture2D(CLOUD_NORMAL_PATH, true, false); 
 
-        program = LoadShadersFromFile(CLOUD_VERT_PATH, CLOUD_FRAG_PATH);
+        program = LoadShadersFromFile(CLOUD_VERT_PATH, CLOUD_FRAG_PATH, FRAME_UNIFORMS_GLSL);
         if (program == 0) std::cerr << "Failed to load cloud shaders.\n";
 
-        mvpLoc = glGetUniformLocation(program, "uMVP");
-        colorLoc = glGetUniformLocation(program, "ucolor");
-
+        // camera, fog and the OIT switch come from the frame uniforms; samplers are fixed
+        bindFrameUniforms(program);
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "ucolor"), 0);
         modelLoc = glGetUniformLocation(program, "uModel");
-        camPosLoc = glGetUniformLocation(program, "cameraPosition");
-        fogColorLoc = glGetUniformLocation(program, "fogColor");
-        fogStartLoc = glGetUniformLocation(program, "fogStart");
-        fogEndLoc = glGetUniformLocation(program, "fogEnd");
 
-        glGenVertexArrays(1, &vao);
-        glBindVertexArray(vao);
+        instProgram = LoadShadersFromFile(CLOUD_INSTANCED_VERT_PATH, CLOUD_FRAG_PATH, FRAME_UNIFORMS_GLSL);
+        if (instProgram == 0) std::cerr << "Failed to load instanced cloud shaders.\n";
 
-        glGenBuffers(1, &vboPos);
-        glBindBuffer(GL_ARRAY_BUFFER, vboPos);
-        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), positions.data(), GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        bindFrameUniforms(instProgram);
+        glUseProgram(instProgram);
+        glUniform1i(glGetUniformLocation(instProgram, "ucolor"), 0);
 
-        glGenBuffers(1, &vboUV);
-        glBindBuffer(GL_ARRAY_BUFFER, vboUV);
-        glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(float), uvs.data(), GL_STATIC_DRAW);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        std::vector<PackedVertex> packed = packVertices();
+        mesh = gGeometry.upload(gFormatPackedMesh, packed.data(), packed.size(), indices.data(), indices.size());
 
-        glGenBuffers(1, &vboN);
-        glBindBuffer(GL_ARRAY_BUFFER, vboN);
-        glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_STATIC_DRAW);
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        vao = gGeometry.createVertexArray(gFormatPackedMesh);
+        glBindVertexArray(vao);
 
-        glGenBuffers(1, &ebo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+        // per-instance model matrix, one column per attribute slot (3..6)
+        instanceCapacity = (size_t)(2 * CLOUD_RADIUS + 1) * (2 * CLOUD_RADIUS + 1);
+        glGenBuffers(1, &instanceVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+        for (int c = 0; c < 4; ++c) {
+            glEnableVertexAttribArray(3 + c);
+            glVertexAttribPointer(3 + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), BUFFER_OFFSET(c * sizeof(glm::vec4)));
+            glVertexAttribDivisor(3 + c, 1);
+        }
 
         glBindVertexArray(0);
+
+        initializeImpostors();
+
+        size_t floatBytes = positions.size() / 3 * 8 * sizeof(float) + indices.size() * sizeof(unsigned int);
+        std::cout << "Cloud mesh: " << positions.size() / 3 << " vertices, " << floatBytes / 1024 << " KiB as floats -> "
+            << (packed.size() * sizeof(PackedVertex) + mesh.indexCount * mesh.indexSize()) / 1024 << " KiB packed\n";
+
+        // everything below reads the arena copy
+        std::vector<float>().swap(positions);
+        std::vector<float>().swap(uvs);
+        std::vector<float>().swap(normals);
+        std::vector<unsigned int>().swap(indices);
+    }
+
+    // Draws one level; the VAO must be bound.
+    void drawLod(int lod, GLsizei instanceCount = 0) const {
+        if ((size_t)lod >= lods.size()) return;
+        const MeshLod& level = lods[lod];
+        const void* offset = BUFFER_OFFSET(mesh.indexByteOffset(level.firstIndex));
+        if (instanceCount > 0)
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, level.indexCount, mesh.indexType, offset, instanceCount, mesh.baseVertex);
+        else
+            glDrawElementsBaseVertex(GL_TRIANGLES, level.indexCount, mesh.indexType, offset, mesh.baseVertex);
+    }
+
+    // Tiles queued with queueMesh since the last clearQueued; packets index into it.
+    struct MeshDraw {
+        glm::mat4 model;
+        int lod;
+    };
+    std::vector<MeshDraw> meshDraws;
+
+    void clearQueued() { meshDraws.clear(); }
+
+    // With weighted blended OIT every cloud packet accumulates into the OIT targets and
+    // leaves depth alone, so that all layers behind the nearest still contribute.
+    static BlendMode blendMode(BlendMode sorted) {
+        return useWeightedOIT ? BLEND_WEIGHTED_OIT : sorted;
+    }
+
+    static void drawMeshPacket(GLStateCache&, void* context, uint32_t item) {
+        const Cloud& cloud = *static_cast<const Cloud*>(context);
+        const MeshDraw& draw = cloud.meshDraws[item];
+        glUniformMatrix4fv(cloud.modelLoc, 1, GL_FALSE, glm::value_ptr(draw.model));
+        cloud.drawLod(draw.lod);
     }
 
-    void render(const glm::mat4& vp, const glm::mat4& modelMat) {
+    // One tile with its own draw; depth in [0, 1] orders it among the blended packets.
+    void queueMesh(RenderQueue& queue, const glm::mat4& modelMat, int lod, float depth) {
         if (!program || !vao || !colorTex) return;
+        MeshDraw draw;
+        draw.model = modelMat * dequantize;
+        draw.lod = lod;
+        meshDraws.push_back(draw);
+        BlendMode blend = blendMode(BLEND_ALPHA);
+        DrawPacket packet = { MakeDrawKey(PASS_COLOR, blend, program, vao, colorTex, depth),
+            program, vao, colorTex, blend, false, !useWeightedOIT, drawMeshPacket, this, (uint32_t)(meshDraws.size() - 1) };
+        queue.push(packet);
+    }
 
-        glUseProgram(program);
-        glm::mat4 mvp = vp * modelMat;
-        glUniformMatrix4fv(mvpLoc, 1, GL_FALSE, glm::value_ptr(mvp));
+    // With groupByLod the instances are regrouped by level, so that drawInstances needs
+    // one draw per level. Otherwise they keep their order (back to front) and every run
+    // of consecutive instances at the same level takes a draw; since the level follows
+    // distance, that is only a few more.
+    void uploadInstances(const std::vector<glm::mat4>& models, const std::vector<uint8_t>& instanceLods,
+        bool groupByLod = true) {
+        instanceRuns.clear();
+        instanceScratch.resize(models.size());
+        if (groupByLod) {
+            GLsizei count[CLOUD_LODS + 1] = {};
+            GLsizei next[CLOUD_LODS + 1];
+            for (uint8_t lod : instanceLods) ++count[lod];
+            GLsizei first = 0;
+            for (int l = 0; l <= CLOUD_LODS; ++l) {
+                next[l] = first;
+                if (count[l] > 0) instanceRuns.push_back(InstanceRun{ (uint8_t)l, first, count[l] });
+                first += count[l];
+            }
+            for (size_t i = 0; i < models.size(); ++i) instanceScratch[next[instanceLods[i]]++] = models[i] * dequantize;
+        }
+        else {
+            for (size_t i = 0; i < models.size(); ++i) {
+                instanceScratch[i] = models[i] * dequantize;
+                if (!instanceRuns.empty() && instanceRuns.back().lod == instanceLods[i]) ++instanceRuns.back().count;
+                else instanceRuns.push_back(InstanceRun{ instanceLods[i], (GLsizei)i, 1 });
+            }
+        }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, colorTex);
-        glUniform1i(colorLoc, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        if (models.size() > instanceCapacity) instanceCapacity = models.size();
+        // orphan the previous contents so the driver does not stall on the last draw
+        glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+        if (!models.empty())
+            glBufferSubData(GL_ARRAY_BUFFER, 0, instanceScratch.size() * sizeof(glm::mat4), instanceScratch.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, gShadowTex);
-        glUniform1i(glGetUniformLocation(program, "uShadowMap"), 7);
+    // One instanced draw per run uploaded last; the VAO must be bound. GL 3.3 has no
+    // base instance, so the per-instance attributes are re-pointed at each run.
+    void drawInstances() const {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        for (const InstanceRun& run : instanceRuns) {
+            for (int c = 0; c < 4; ++c) {
+                glVertexAttribPointer(3 + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                    BUFFER_OFFSET(run.first * sizeof(glm::mat4) + c * sizeof(glm::vec4)));
+            }
+            drawLod(run.lod, run.count);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
-        glUniformMatrix4fv(glGetUniformLocation(program, "uLightVP"), 1, GL_FALSE, glm::value_ptr(gLightVP));
+    static void drawInstancesPacket(GLStateCache&, void* context, uint32_t) {
+        static_cast<const Cloud*>(context)->drawInstances();
+    }
 
-        glUniform3fv(glGetUniformLocation(program, "lightPosition"), 1, &lightPosition[0]);
-        glUniform3fv(glGetUniformLocation(program, "lightIntensity"), 1, &lightIntensity[0]);
+    // Uploads the instances now, in the given order when sorted; a single packet draws
+    // them all.
+    void queueInstanced(RenderQueue& queue, const std::vector<glm::mat4>& models, const std::vector<uint8_t>& instanceLods,
+        float depth, bool sorted) {
+        if (!instProgram || !vao || !colorTex || models.empty()) return;
+        uploadInstances(models, instanceLods, !sorted);
+        BlendMode blend = blendMode(BLEND_ALPHA);
+        DrawPacket packet = { MakeDrawKey(PASS_COLOR, blend, instProgram, vao, colorTex, depth),
+            instProgram, vao, colorTex, blend, false, !useWeightedOIT, drawInstancesPacket, this, 0 };
+        queue.push(packet);
+    }
 
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
+    // Atlas frame (i, j) looks at the mesh from the octahedral direction at its center,
+    // with the y axis as the pole so that the horizon gets the most frames.
+    static glm::vec3 impostorDirection(int i, int j) {
+        glm::vec2 e = glm::vec2((i + 0.5f) / CLOUD_IMPOSTOR_FRAMES, (j + 0.5f) / CLOUD_IMPOSTOR_FRAMES) * 2.0f - 1.0f;
+        glm::vec3 d(e.x, 1.0f - fabsf(e.x) - fabsf(e.y), e.y);
+        if (d.y < 0.0f) {
+            float x = d.x;
+            d.x = (1.0f - fabsf(d.z)) * (x >= 0.0f ? 1.0f : -1.0f);
+            d.z = (1.0f - fabsf(x)) * (d.z >= 0.0f ? 1.0f : -1.0f);
+        }
+        return glm::normalize(d);
+    }
 
-        glUniform3fv(camPosLoc, 1, &eye_center[0]);
+    void initializeImpostors() {
+        impostorProgram = LoadShadersFromFile(CLOUD_IMPOSTOR_VERT_PATH, CLOUD_IMPOSTOR_FRAG_PATH, FRAME_UNIFORMS_GLSL);
+        if (impostorProgram == 0) {
+            std::cerr << "Failed to load cloud impostor shaders.\n";
+            return;
+        }
+        bindFrameUniforms(impostorProgram);
+        glUseProgram(impostorProgram);
+        glUniform1i(glGetUniformLocation(impostorProgram, "uImpostorColor"), 0);
+        glUniform1i(glGetUniformLocation(impostorProgram, "uImpostorDepth"), 1);
+        glUniform1i(glGetUniformLocation(impostorProgram, "uImpostorFrames"), CLOUD_IMPOSTOR_FRAMES);
+
+        glGenVertexArrays(1, &impostorVAO);
+        glBindVertexArray(impostorVAO);
+        impostorCapacity = (size_t)(2 * CLOUD_RADIUS + 1) * (2 * CLOUD_RADIUS + 1);
+        glGenBuffers(1, &impostorVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, impostorVBO);
+        glBufferData(GL_ARRAY_BUFFER, impostorCapacity * sizeof(ImpostorInstance), nullptr, GL_STREAM_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(ImpostorInstance), BUFFER_OFFSET(offsetof(ImpostorInstance, centerRadius)));
+        glVertexAttribDivisor(0, 1);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(ImpostorInstance), BUFFER_OFFSET(offsetof(ImpostorInstance, rotY)));
+        glVertexAttribDivisor(1, 1);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        glm::vec3 fogCol(0.6f, 0.7f, 0.85f);
-        glUniform3fv(fogColorLoc, 1, &fogCol[0]);
+        bakeImpostors();
+    }
 
-        glUniform1f(fogStartLoc, 1200.0f);
-        glUniform1f(fogEndLoc, 6000.0f);
+    // Renders every atlas frame with the instanced cloud program, fog pushed out of reach,
+    // blending color premultiplied into a transparent target.
+    void bakeImpostors() {
+        int size = CLOUD_IMPOSTOR_FRAMES * CLOUD_IMPOSTOR_FRAME_RES;
+
+        glGenTextures(1, &impostorColorTex);
+        glBindTexture(GL_TEXTURE_2D, impostorColorTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glGenTextures(1, &impostorDepthTex);
+        glBindTexture(GL_TEXTURE_2D, impostorDepthTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        GLuint fbo;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostorColorTex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, impostorDepthTex, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Impostor FBO not complete!\n";
+
+        GLfloat clearColor[4];
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glViewport(0, 0, size, size);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glEnable(GL_DEPTH_TEST);
         glDisable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+        glUseProgram(instProgram);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, colorTex);
+
+        // the frame uniforms are not in use yet; each view gets its own
+        FrameUniforms view = FrameUniforms();
+        view.cameraPosition = localCenter;
+        view.fogColor = FOG_COLOR;
+        view.fogStart = 1e30f;
+        view.fogEnd = 2e30f;
 
+        uploadInstances(std::vector<glm::mat4>(1, glm::mat4(1.0f)), std::vector<uint8_t>(1, 0));
         glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, (void*)0);
+        float r = localRadius;
+        glm::mat4 proj = glm::ortho(-r, r, -r, r, r, 3.0f * r);
+        for (int j = 0; j < CLOUD_IMPOSTOR_FRAMES; ++j) {
+            for (int i = 0; i < CLOUD_IMPOSTOR_FRAMES; ++i) {
+                glm::vec3 d = impostorDirection(i, j);
+                glm::vec3 up = fabsf(d.y) > 0.999f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+                view.viewProj = proj * glm::lookAt(localCenter + d * 2.0f * r, localCenter, up);
+                uploadFrameUniforms(view);
+                glViewport(i * CLOUD_IMPOSTOR_FRAME_RES, j * CLOUD_IMPOSTOR_FRAME_RES,
+                    CLOUD_IMPOSTOR_FRAME_RES, CLOUD_IMPOSTOR_FRAME_RES);
+                drawInstances();
+            }
+        }
         glBindVertexArray(0);
 
         glDisable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         glEnable(GL_CULL_FACE);
+        glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &fbo);
+
+        glBindTexture(GL_TEXTURE_2D, impostorColorTex);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    static void drawImpostorsPacket(GLStateCache& gl, void* context, uint32_t count) {
+        gl.bindTexture(1, static_cast<const Cloud*>(context)->impostorDepthTex);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)count);
+    }
+
+    void queueImpostors(RenderQueue& queue, const std::vector<ImpostorInstance>& instances, float depth) {
+        if (!impostorProgram || !impostorColorTex || instances.empty()) return;
+
+        glBindBuffer(GL_ARRAY_BUFFER, impostorVBO);
+        if (instances.size() > impostorCapacity) impostorCapacity = instances.size();
+        glBufferData(GL_ARRAY_BUFFER, impostorCapacity * sizeof(ImpostorInstance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(ImpostorInstance), instances.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        BlendMode blend = blendMode(BLEND_PREMULTIPLIED);
+        DrawPacket packet = { MakeDrawKey(PASS_COLOR, blend, impostorProgram, impostorVAO, impostorColorTex, depth),
+            impostorProgram, impostorVAO, impostorColorTex, blend, false, !useWeightedOIT,
+            drawImpostorsPacket, this, (uint32_t)instances.size() };
+        queue.push(packet);
     }
 
     void cleanup() {
         if (program) glDeleteProgram(program);
+        if (instProgram) glDeleteProgram(instProgram);
+        if (impostorProgram) glDeleteProgram(impostorProgram);
+        if (impostorColorTex) glDeleteTextures(1, &impostorColorTex);
+        if (impostorDepthTex) glDeleteTextures(1, &impostorDepthTex);
+        if (impostorVBO) glDeleteBuffers(1, &impostorVBO);
+        if (impostorVAO) glDeleteVertexArrays(1, &impostorVAO);
         if (colorTex) glDeleteTextures(1, &colorTex);
         if (normalTex) glDeleteTextures(1, &normalTex);
-        if (vboPos) glDeleteBuffers(1, &vboPos);
-        if (vboUV) glDeleteBuffers(1, &vboUV);
-        if (ebo) glDeleteBuffers(1, &ebo);
-        if (vao) glDeleteVertexArrays(1, &vao);
+        gGeometry.release(mesh);
+        if (instanceVBO) glDeleteBuffers(1, &instanceVBO);
+        if (vao) gGeometry.destroyVertexArray(vao);
     }
 };
 
 struct MyBot {
-    GLuint mvpMatrixID = 0;
     GLuint jointMatricesID = 0;
-    GLuint lightPositionID = 0;
-    GLuint lightIntensityID = 0;
     GLuint programID = 0;
 
-    GLint cameraPosID = -1;
-    GLint fogColorID = -1;
-    GLint fogStartID = -1;
-    GLint fogEndID = -1;
-
-    tinygltf::Model model;
+    GLint preSkinnedID = -1;
+    GLint instancedID = -1;
+    GLint palettesID = -1;
+    GLint bakedID = -1, bakedFrameCountID = -1, bakedFPSID = -1;
+    GLuint skinTFProgramID = 0;
+    GLint skinTFJointsID = -1;
 
     GLint modelID = -1;
 
-    struct PrimitiveObject {
+    // Arena vertex of the bot: the glTF attributes the shaders read, converted to one
+    // interleaved layout whatever component types the file stores them in.
+    struct SkinnedVertex {
+        float position[3];
+        float normal[3];
+        float uv[2];
+        uint16_t joints[4];
+        float weights[4];
+    };
+
+    // One draw of the compiled model: all a glDraw*BaseVertex call needs, so drawing
+    // walks a flat array instead of the glTF node tree.
+    struct DrawCommand {
         GLuint vao;
-        std::map<int, GLuint> vbos;
+        GLenum mode;
+        GLsizei count;
+        GLenum indexType;
+        size_t indexOffset;     // bytes
+        GLint baseVertex;
     };
-    std::vector<PrimitiveObject> primitiveObjects;
+    std::vector<DrawCommand> drawCommands;          // skinned in the vertex shader
+    std::vector<DrawCommand> preSkinnedCommands;    // the same draws from the pre-skinned buffer
+
+    // Every primitive's vertices and indices sit in one arena range (mesh).
+    MeshRange mesh;
+    GLuint vao = 0;
+
+    // pre-skinned copy of the vertices (position + normal), written by transform feedback;
+    // staticVAO reads it with the arena's indices
+    GLuint skinnedVBO = 0;
+    GLuint staticVAO = 0;
 
     struct SkinObject {
         std::vector<glm::mat4> inverseBindMatrices;
@@ -682,15 +1394,118 @@ struct MyBot {
     };
     std::vector<SkinObject> skinObjects;
 
+    enum class ChannelPath { Translation, Rotation, Scale };
+
+    // Keys of one sampler. Compressed samplers keep only the keys interpolation cannot
+    // reproduce, packed as three 16-bit values each (see compressSampler), and leave
+    // output empty.
     struct SamplerObject {
         std::vector<float> input;
         std::vector<glm::vec4> output;
         int interpolation;
+
+        ChannelPath path = ChannelPath::Translation;
+        std::vector<uint16_t> packed;
+        glm::vec3 rangeMin = glm::vec3(0.0f);
+        glm::vec3 rangeStep = glm::vec3(0.0f);    // per quantization step, translation/scale
+    };
+
+    struct CompressionReport {
+        size_t keysBefore = 0, keysAfter = 0;
+        size_t bytesBefore = 0, bytesAfter = 0;
+        float maxError[3] = { 0.0f, 0.0f, 0.0f };   // per ChannelPath; radians for rotation
+    };
+
+    // A channel resolved at load time: no accessor lookups or path strings per frame.
+    struct ChannelObject {
+        int node;
+        int slot;       // position of the node in the flattened skeleton
+        int lane;       // position of the node in the animation's TRS batch
+        ChannelPath path;
+        const SamplerObject* sampler;
+        int samplerIndex;   // selects the keyframe cursor
+    };
+
+    // samplers is filled before channels point into it and is only ever moved afterwards,
+    // which keeps the sampler pointers valid.
+    struct AnimationObject {
+        std::vector<SamplerObject> samplers;
+        std::vector<ChannelObject> channels;
+        std::vector<int> animatedSlots;     // each channel target once
+        TRSBatch restPose;                  // rest T/R/S of animatedSlots, same order
     };
-    struct AnimationObject { std::vector<SamplerObject> samplers; };
     std::vector<AnimationObject> animationObjects;
 
-    glm::mat4 getNodeTransform(const tinygltf::Node& node) {
+    struct NodeTRS {
+        glm::vec3 translation;
+        glm::quat rotation;
+        glm::vec3 scale;
+    };
+
+    // Skin 0 flattened at load time: only the joints and their ancestors below the skeleton
+    // root, parents before children. Slot k holds node skeletonNodes[k]; skeletonParents[k]
+    // is its parent's slot, or -1 for the root.
+    std::vector<int> skeletonNodes;
+    std::vector<int> skeletonParents;
+    std::vector<int> jointSlots;
+
+    // Rest pose per slot; animated nodes also keep theirs as T/R/S (AnimationObject::restPose)
+    // for the channels to overwrite.
+    std::vector<glm::mat4> restLocalTransforms;
+
+    // Per-thread scratch for pose evaluation, indexed by slot (trs by lane); once sized,
+    // evaluating a pose does not allocate.
+    struct PoseScratch {
+        TRSBatch trs;
+        std::vector<glm::mat4> localTransforms;
+        std::vector<glm::mat4> globalTransforms;
+    };
+    PoseScratch poseScratch;    // used by update() on the main thread
+    std::vector<int> sharedCursors;
+
+    // Keyframe cursors of the field's bots, samplerCursorCount() per bot index.
+    std::vector<int> instanceCursors;
+
+    // Per-instance poses: the palettes live in one texture buffer and every instance
+    // finds its own through paletteBase (in matrices).
+    struct BotInstance {
+        glm::mat4 model;
+        GLint paletteBase;
+        GLfloat animTime;
+        GLint pad[2];
+    };
+    GLuint instanceVBO = 0;
+    size_t instanceCapacity = 0;
+    std::vector<BotInstance> instances;
+
+    GLuint paletteTBO = 0, paletteTex = 0;
+    size_t paletteCapacity = 0;
+    // jointCount() matrices per bot index, kept across frames so that bots on a lower
+    // animation LOD can reuse their last pose.
+    std::vector<glm::mat4> palettes;
+    std::vector<unsigned> paletteFrame;     // instanceFrame in which the bot was last considered
+    std::vector<uint8_t> paletteValid;
+    unsigned instanceFrame = 0;
+    std::vector<size_t> missingPalettes;
+
+    struct AnimLodStats {
+        size_t bots[BOT_ANIM_LODS];
+        size_t evaluated[BOT_ANIM_LODS];
+    };
+    AnimLodStats lodStats = {};
+
+    // Baked animation: clip 0 sampled bakedFrameCount times over its duration (so bakedFPS
+    // is bakedFrameCount / duration) into a float texture, one row per frame and three
+    // RGBA32F texels (the rows of the affine 3x4 matrix) per joint.
+    GLuint bakedTex = 0;
+    int bakedFrameCount = 0;
+    float bakedFPS = 30.0f;
+
+    // bounding sphere of the bind-pose skinned mesh, in model space
+    glm::vec3 boundCenter = glm::vec3(0.0f);
+    float boundRadius = 0.0f;
+
+    glm::mat4 getNodeTransform(const tinygltf::Node& node) const {
         glm::mat4 transform(1.0f);
         if (node.matrix.size() == 16) {
             transform = glm::make_mat4(node.matrix.data());
@@ -708,7 +1523,111 @@ struct MyBot {
         return transform;
     }
 
-    void computeLocalNodeTransform(const tinygltf::Model& model, int nodeIndex, std::vector<glm::mat4>& localTransforms) {
+    NodeTRS getNodeTRS(const tinygltf::Node& node) const {
+        NodeTRS trs;
+        trs.translation = glm::vec3(0.0f);
+        trs.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        trs.scale = glm::vec3(1.0f);
+        if (node.matrix.size() == 16) {
+            // glTF never animates nodes given as a matrix; decompose once so it still works
+            glm::mat4 M = glm::make_mat4(node.matrix.data());
+            trs.translation = glm::vec3(M[3]);
+            trs.scale = glm::vec3(glm::length(glm::vec3(M[0])), glm::length(glm::vec3(M[1])), glm::length(glm::vec3(M[2])));
+            glm::mat3 rotMat(
+                glm::vec3(M[0]) / (trs.scale.x == 0 ? 1.f : trs.scale.x),
+                glm::vec3(M[1]) / (trs.scale.y == 0 ? 1.f : trs.scale.y),
+                glm::vec3(M[2]) / (trs.scale.z == 0 ? 1.f : trs.scale.z)
+            );
+            trs.rotation = glm::quat_cast(rotMat);
+            return trs;
+        }
+        if (node.translation.size() == 3)
+            trs.translation = glm::vec3(node.translation[0], node.translation[1], node.translation[2]);
+        if (node.rotation.size() == 4)
+            trs.rotation = glm::quat((float)node.rotation[3], (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2]);
+        if (node.scale.size() == 3)
+            trs.scale = glm::vec3(node.scale[0], node.scale[1], node.scale[2]);
+        return trs;
+    }
+
+    bool subtreeHasJoint(const tinygltf::Model& model, int nodeIndex, const std::vector<uint8_t>& isJoint) const {
+        if (isJoint[nodeIndex]) return true;
+        for (int child : model.nodes[nodeIndex].children)
+            if (subtreeHasJoint(model, child, isJoint)) return true;
+        return false;
+    }
+
+    // Builds the flattened skeleton and remaps the animation channels onto its slots;
+    // channels on nodes that cannot move a joint are dropped. Clears skinObjects if a
+    // joint is not reachable from the skeleton root.
+    void prepareSkeleton(const tinygltf::Model& model) {
+        if (model.skins.empty()) return;
+        const tinygltf::Skin& skin = model.skins[0];
+        int rootIndex = (skin.skeleton >= 0) ? skin.skeleton : skin.joints[0];
+
+        std::vector<uint8_t> isJoint(model.nodes.size(), 0);
+        for (int joint : skin.joints) isJoint[joint] = 1;
+
+        std::vector<int> nodeSlot(model.nodes.size(), -1);
+        std::vector<std::pair<int, int> > stack(1, std::make_pair(rootIndex, -1));
+        while (!stack.empty()) {
+            int nodeIndex = stack.back().first;
+            int parentSlot = stack.back().second;
+            stack.pop_back();
+            if (!subtreeHasJoint(model, nodeIndex, isJoint)) continue;
+
+            int slot = (int)skeletonNodes.size();
+            nodeSlot[nodeIndex] = slot;
+            skeletonNodes.push_back(nodeIndex);
+            skeletonParents.push_back(parentSlot);
+            const std::vector<int>& children = model.nodes[nodeIndex].children;
+            for (size_t i = children.size(); i-- > 0;)
+                stack.push_back(std::make_pair(children[i], slot));
+        }
+
+        // A joint outside the root's subtree has no slot to read its transform from;
+        // drop the skin rather than index past the skeleton every frame.
+        jointSlots.resize(skin.joints.size());
+        for (size_t j = 0; j < skin.joints.size(); ++j) {
+            jointSlots[j] = nodeSlot[skin.joints[j]];
+            if (jointSlots[j] < 0) {
+                std::cerr << "Skin joint " << j << " (node " << skin.joints[j] << ") is not under skeleton root "
+                    << rootIndex << "; skinning disabled.\n";
+                skinObjects.clear();
+                jointSlots.clear();
+                skeletonNodes.clear();
+                skeletonParents.clear();
+                return;
+            }
+        }
+
+        restLocalTransforms.resize(skeletonNodes.size());
+        for (size_t k = 0; k < skeletonNodes.size(); ++k)
+            restLocalTransforms[k] = getNodeTransform(model.nodes[skeletonNodes[k]]);
+
+        for (AnimationObject& animationObject : animationObjects) {
+            std::vector<ChannelObject> channels;
+            std::vector<int>& slots = animationObject.animatedSlots;
+            slots.clear();
+            for (ChannelObject channel : animationObject.channels) {
+                channel.slot = nodeSlot[channel.node];
+                if (channel.slot < 0) continue;
+                std::vector<int>::iterator it = std::find(slots.begin(), slots.end(), channel.slot);
+                channel.lane = (int)(it - slots.begin());
+                if (it == slots.end()) slots.push_back(channel.slot);
+                channels.push_back(channel);
+            }
+            animationObject.channels.swap(channels);
+
+            animationObject.restPose.clear();
+            for (int slot : slots) {
+                NodeTRS rest = getNodeTRS(model.nodes[skeletonNodes[slot]]);
+                animationObject.restPose.push(rest.translation, rest.rotation, rest.scale);
+            }
+        }
+    }
+
+    void computeLocalNodeTransform(const tinygltf::Model& model, int nodeIndex, std::vector<glm::mat4>& localTransforms) const {
         const tinygltf::Node& node = model.nodes[nodeIndex];
         localTransforms[nodeIndex] = getNodeTransform(node);
         for (size_t i = 0; i < node.children.size(); ++i)
@@ -718,7 +1637,7 @@ struct MyBot {
     void computeGlobalNodeTransform(const tinygltf::Model& model,
         const std::vector<glm::mat4>& localTransforms,
         int nodeIndex, const glm::mat4& parentTransform,
-        std::vector<glm::mat4>& globalTransforms) {
+        std::vector<glm::mat4>& globalTransforms) const {
         glm::mat4 global = parentTransform * localTransforms[nodeIndex];
         globalTransforms[nodeIndex] = global;
         const tinygltf::Node& node = model.nodes[nodeIndex];
@@ -765,20 +1684,174 @@ struct MyBot {
         return out;
     }
 
-    int findKeyframeIndex(const std::vector<float>& times, float animationTime) {
-        int left = 0;
-        int right = (int)times.size() - 1;
-        while (left <= right) {
-            int mid = (left + right) / 2;
-            if (mid + 1 < (int)times.size() && times[mid] <= animationTime && animationTime < times[mid + 1]) return mid;
-            else if (times[mid] > animationTime) right = mid - 1;
-            else left = mid + 1;
+    static float readAccessorComponent(const tinygltf::Model& model, const tinygltf::Accessor& accessor, size_t i, int c) {
+        const tinygltf::BufferView& view = model.bufferViews[accessor.bufferView];
+        const unsigned char* p = model.buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset +
+            i * accessor.ByteStride(view) + c * tinygltf::GetComponentSizeInBytes(accessor.componentType);
+        switch (accessor.componentType) {
+        case TINYGLTF_COMPONENT_TYPE_FLOAT: { float v; memcpy(&v, p, sizeof(v)); return v; }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: return accessor.normalized ? *p / 255.0f : (float)*p;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+            unsigned short v; memcpy(&v, p, sizeof(v));
+            return accessor.normalized ? v / 65535.0f : (float)v;
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: { unsigned int v; memcpy(&v, p, sizeof(v)); return (float)v; }
+        default: return 0.0f;
+        }
+    }
+
+    // Skins every vertex with the bind-pose palette once at load to get a model-space
+    // bounding sphere for culling; the margin covers the limbs swinging during the run cycle.
+    void computeBindPoseBounds(const tinygltf::Model& model) {
+        if (skinObjects.empty()) return;
+        const std::vector<glm::mat4>& palette = skinObjects[0].jointMatrices;
+
+        glm::vec3 mn(1e30f), mx(-1e30f);
+        for (const tinygltf::Mesh& mesh : model.meshes) {
+            for (const tinygltf::Primitive& prim : mesh.primitives) {
+                auto itPos = prim.attributes.find("POSITION");
+                auto itJ = prim.attributes.find("JOINTS_0");
+                auto itW = prim.attributes.find("WEIGHTS_0");
+                if (itPos == prim.attributes.end() || itJ == prim.attributes.end() || itW == prim.attributes.end())
+                    continue;
+                const tinygltf::Accessor& posAcc = model.accessors[itPos->second];
+                const tinygltf::Accessor& jAcc = model.accessors[itJ->second];
+                const tinygltf::Accessor& wAcc = model.accessors[itW->second];
+
+                for (size_t v = 0; v < posAcc.count; ++v) {
+                    glm::vec4 p(readAccessorComponent(model, posAcc, v, 0),
+                        readAccessorComponent(model, posAcc, v, 1),
+                        readAccessorComponent(model, posAcc, v, 2), 1.0f);
+                    glm::mat4 skinMat(0.0f);
+                    for (int k = 0; k < 4; ++k) {
+                        int j = (int)readAccessorComponent(model, jAcc, v, k);
+                        if (j < 0 || j >= (int)palette.size()) continue;
+                        skinMat += readAccessorComponent(model, wAcc, v, k) * palette[j];
+                    }
+                    glm::vec3 sp = glm::vec3(skinMat * p);
+                    mn = glm::min(mn, sp);
+                    mx = glm::max(mx, sp);
+                }
+            }
+        }
+        if (mn.x > mx.x) return;
+
+        boundCenter = 0.5f * (mn + mx);
+        boundRadius = 0.5f * glm::length(mx - mn) * 1.25f;
+    }
+
+    // Reorders each triangle primitive's indices in the loaded buffers before they are
+    // uploaded (see Cloud::optimizeMesh). Vertices are renumbered too when no other
+    // primitive shares the primitive's vertex or index accessors.
+    void optimizeMeshes(tinygltf::Model& model) {
+        std::vector<int> accessorUsers(model.accessors.size(), 0);
+        for (const tinygltf::Mesh& mesh : model.meshes) {
+            for (const tinygltf::Primitive& prim : mesh.primitives) {
+                if (prim.indices >= 0) ++accessorUsers[prim.indices];
+                for (auto& attrib : prim.attributes) ++accessorUsers[attrib.second];
+                for (auto& target : prim.targets)
+                    for (auto& attrib : target) ++accessorUsers[attrib.second];
+            }
+        }
+
+        size_t triangles = 0;
+        float acmrBefore = 0.0f, acmrAfter = 0.0f, atvrBefore = 0.0f, atvrAfter = 0.0f;
+        for (tinygltf::Mesh& mesh : model.meshes) {
+            for (tinygltf::Primitive& prim : mesh.primitives) {
+                auto itPos = prim.attributes.find("POSITION");
+                if (prim.mode != TINYGLTF_MODE_TRIANGLES || prim.indices < 0 || itPos == prim.attributes.end()) continue;
+                const tinygltf::Accessor& idxAcc = model.accessors[prim.indices];
+                const tinygltf::Accessor& posAcc = model.accessors[itPos->second];
+                if (idxAcc.sparse.isSparse || idxAcc.bufferView < 0 || posAcc.bufferView < 0) continue;
+
+                size_t vertexCount = posAcc.count;
+                std::vector<float> positions(vertexCount * 3);
+                for (size_t v = 0; v < vertexCount; ++v)
+                    for (int c = 0; c < 3; ++c) positions[v * 3 + c] = readAccessorComponent(model, posAcc, v, c);
+                std::vector<uint32_t> indices(idxAcc.count);
+                for (size_t i = 0; i < indices.size(); ++i) indices[i] = (uint32_t)readAccessorComponent(model, idxAcc, i, 0);
+
+                VertexCacheStats before = AnalyzeVertexCache(indices, vertexCount);
+                OptimizeTriangleOrder(indices, vertexCount, positions.data());
+
+                std::vector<int> vertexAccessors;
+                bool exclusive = accessorUsers[prim.indices] == 1;
+                for (auto& attrib : prim.attributes) vertexAccessors.push_back(attrib.second);
+                for (auto& target : prim.targets)
+                    for (auto& attrib : target) vertexAccessors.push_back(attrib.second);
+                for (int a : vertexAccessors) {
+                    const tinygltf::Accessor& acc = model.accessors[a];
+                    if (accessorUsers[a] != 1 || acc.sparse.isSparse || acc.bufferView < 0 || acc.count != vertexCount)
+                        exclusive = false;
+                }
+                if (exclusive) {
+                    std::vector<uint32_t> remap = OptimizeVertexFetch(indices, vertexCount);
+                    for (int a : vertexAccessors) {
+                        const tinygltf::Accessor& acc = model.accessors[a];
+                        const tinygltf::BufferView& view = model.bufferViews[acc.bufferView];
+                        size_t elementSize = tinygltf::GetComponentSizeInBytes(acc.componentType) *
+                            tinygltf::GetNumComponentsInType(acc.type);
+                        RemapVertexAttribute(model.buffers[view.buffer].data.data() + view.byteOffset + acc.byteOffset,
+                            vertexCount, elementSize, acc.ByteStride(view), remap);
+                    }
+                }
+                VertexCacheStats after = AnalyzeVertexCache(indices, vertexCount);
+
+                const tinygltf::BufferView& idxView = model.bufferViews[idxAcc.bufferView];
+                unsigned char* dst = model.buffers[idxView.buffer].data.data() + idxView.byteOffset + idxAcc.byteOffset;
+                int stride = idxAcc.ByteStride(idxView);
+                for (size_t i = 0; i < indices.size(); ++i, dst += stride) {
+                    switch (idxAcc.componentType) {
+                    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: *dst = (unsigned char)indices[i]; break;
+                    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: { unsigned short v = (unsigned short)indices[i]; memcpy(dst, &v, sizeof(v)); break; }
+                    default: memcpy(dst, &indices[i], sizeof(uint32_t)); break;
+                    }
+                }
+
+                size_t n = indices.size() / 3;
+                triangles += n;
+                acmrBefore += before.acmr * n;
+                acmrAfter += after.acmr * n;
+                atvrBefore += before.atvr * n;
+                atvrAfter += after.atvr * n;
+            }
+        }
+
+        if (triangles > 0) {
+            std::cout << "Bot mesh vertex cache: ACMR " << std::setprecision(3) << acmrBefore / triangles << " -> "
+                << acmrAfter / triangles << ", ATVR " << atvrBefore / triangles << " -> " << atvrAfter / triangles
+                << "\n" << std::setprecision(6);
+        }
+    }
+
+    // Index k of the key interval [times[k], times[k + 1]) containing animationTime, clamped
+    // to [0, size - 2] so times before the first key or at the last one still interpolate.
+    static int findKeyframeIndex(const std::vector<float>& times, float animationTime) {
+        int k = (int)(std::upper_bound(times.begin(), times.end(), animationTime) - times.begin()) - 1;
+        return glm::clamp(k, 0, (int)times.size() - 2);
+    }
+
+    // Same result as findKeyframeIndex, starting from the interval found last time. Playback
+    // moves forward by a frame or so, which is a few steps at most; a wrap back to the start
+    // or a jump elsewhere in the clip falls back to the binary search.
+    static int advanceKeyframeCursor(const std::vector<float>& times, float animationTime, int& cursor) {
+        const int last = (int)times.size() - 2;
+        int k = glm::clamp(cursor, 0, last);
+        if (animationTime < times[k]) {
+            k = (animationTime < times[1]) ? 0 : findKeyframeIndex(times, animationTime);
         }
-        return (int)times.size() - 2;
+        else {
+            int steps = 0;
+            while (k < last && animationTime >= times[k + 1] && steps < 4) { ++k; ++steps; }
+            if (k < last && animationTime >= times[k + 1]) k = findKeyframeIndex(times, animationTime);
+        }
+        cursor = k;
+        return k;
     }
 
     std::vector<AnimationObject> prepareAnimation(const tinygltf::Model& model) {
         std::vector<AnimationObject> animationObjects;
+        CompressionReport report;
         for (const auto& anim : model.animations) {
             AnimationObject animationObject;
             for (const auto& sampler : anim.samplers) {
@@ -810,457 +1883,2067 @@ struct MyBot {
 
                 animationObject.samplers.push_back(samplerObject);
             }
-            animationObjects.push_back(animationObject);
+
+            for (const auto& channel : anim.channels) {
+                if (channel.target_node < 0 || (size_t)channel.target_node >= model.nodes.size()) continue;
+                if (channel.sampler < 0 || (size_t)channel.sampler >= animationObject.samplers.size()) continue;
+
+                ChannelObject channelObject;
+                if (channel.target_path == "translation") channelObject.path = ChannelPath::Translation;
+                else if (channel.target_path == "rotation") channelObject.path = ChannelPath::Rotation;
+                else if (channel.target_path == "scale") channelObject.path = ChannelPath::Scale;
+                else continue;  // morph target weights are not supported
+                channelObject.node = channel.target_node;
+                channelObject.slot = -1;    // slot and lane are assigned by prepareSkeleton
+                channelObject.lane = -1;
+                channelObject.sampler = &animationObject.samplers[channel.sampler];
+                channelObject.samplerIndex = channel.sampler;
+                if (channelObject.sampler->input.empty()) continue;
+                animationObject.channels.push_back(channelObject);
+            }
+
+            if (useAnimationCompression) {
+                for (const ChannelObject& channel : animationObject.channels)
+                    compressSampler(animationObject.samplers[channel.samplerIndex], channel.path, report);
+            }
+            animationObjects.push_back(std::move(animationObject));
+        }
+
+        if (report.keysBefore > 0) {
+            std::cout << "Compressed bot animation: " << report.keysBefore << " -> " << report.keysAfter << " keys, "
+                << report.bytesBefore / 1024 << " -> " << report.bytesAfter / 1024 << " KiB ("
+                << std::setprecision(3) << (float)report.bytesBefore / report.bytesAfter << "x), max error "
+                << report.maxError[(int)ChannelPath::Translation] << " translation, "
+                << glm::degrees(report.maxError[(int)ChannelPath::Rotation]) << " deg rotation, "
+                << report.maxError[(int)ChannelPath::Scale] << " scale\n" << std::setprecision(6);
         }
         return animationObjects;
     }
 
-    void updateAnimation(const tinygltf::Model& model,
-        const tinygltf::Animation& anim,
-        const AnimationObject& animationObject,
-        float time,
-        std::vector<glm::mat4>& nodeTransforms) {
-        for (const auto& channel : anim.channels) {
-            int targetNodeIndex = channel.target_node;
-            if (targetNodeIndex < 0 || (size_t)targetNodeIndex >= nodeTransforms.size()) continue;
+    // Smallest-three quaternion: the largest component is dropped (and made positive by
+    // flipping the sign of q), the other three lie in [-1/sqrt2, 1/sqrt2] and get 15 bits
+    // each. The dropped index goes in the top bits of the first two values.
+    static void packQuaternion(const glm::vec4& q, uint16_t* out) {
+        int largest = 0;
+        for (int c = 1; c < 4; ++c)
+            if (fabsf(q[c]) > fabsf(q[largest])) largest = c;
+        float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+        const float range = 0.70710678f;
+        for (int c = 0, k = 0; c < 4; ++c) {
+            if (c == largest) continue;
+            float v = glm::clamp(sign * q[c] / range, -1.0f, 1.0f);
+            out[k++] = (uint16_t)lroundf((v * 0.5f + 0.5f) * 32767.0f);
+        }
+        out[0] |= (uint16_t)((largest & 1) << 15);
+        out[1] |= (uint16_t)((largest >> 1) << 15);
+    }
 
-            const auto& sampler = anim.samplers[channel.sampler];
-            const tinygltf::Accessor& outputAccessor = model.accessors[sampler.output];
-            const tinygltf::BufferView& outputBufferView = model.bufferViews[outputAccessor.bufferView];
-            const tinygltf::Buffer& outputBuffer = model.buffers[outputBufferView.buffer];
-            const std::vector<float>& times = animationObject.samplers[channel.sampler].input;
-            if (times.size() < 2) continue;
+    static glm::vec4 unpackQuaternion(const uint16_t* in) {
+        int largest = (in[0] >> 15) | ((in[1] >> 15) << 1);
+        const float range = 0.70710678f;
+        glm::vec4 q;
+        float sum = 0.0f;
+        for (int c = 0, k = 0; c < 4; ++c) {
+            if (c == largest) continue;
+            float v = ((in[k++] & 0x7fff) / 32767.0f * 2.0f - 1.0f) * range;
+            q[c] = v;
+            sum += v * v;
+        }
+        q[largest] = sqrtf(glm::max(0.0f, 1.0f - sum));
+        return q;
+    }
 
-            float animationTime = fmod(time, times.back());
-            int keyframeIndex = findKeyframeIndex(times, animationTime);
-            int nextIndex = glm::min(keyframeIndex + 1, (int)times.size() - 1);
+    static glm::vec4 decodeKey(const SamplerObject& sampler, int k) {
+        if (sampler.packed.empty()) return sampler.output[k];
+        const uint16_t* in = &sampler.packed[k * 3];
+        if (sampler.path == ChannelPath::Rotation) return unpackQuaternion(in);
+        return glm::vec4(sampler.rangeMin + sampler.rangeStep * glm::vec3(in[0], in[1], in[2]), 0.0f);
+    }
 
-            float t0 = times[keyframeIndex];
-            float t1 = times[nextIndex];
-            float factor = (t1 > t0) ? (animationTime - t0) / (t1 - t0) : 0.0f;
-            factor = glm::clamp(factor, 0.0f, 1.0f);
+    static glm::vec4 interpolateKey(ChannelPath path, const glm::vec4& v0, const glm::vec4& v1, float factor) {
+        if (path != ChannelPath::Rotation) return glm::vec4(glm::mix(glm::vec3(v0), glm::vec3(v1), factor), 0.0f);
+        glm::quat q0 = glm::normalize(glm::quat(v0.w, v0.x, v0.y, v0.z));
+        glm::quat q1 = glm::normalize(glm::quat(v1.w, v1.x, v1.y, v1.z));
+        glm::quat q = glm::normalize(glm::slerp(q0, q1, factor));
+        return glm::vec4(q.x, q.y, q.z, q.w);
+    }
 
-            const unsigned char* outputPtr = &outputBuffer.data[outputBufferView.byteOffset + outputAccessor.byteOffset];
+    // Rotation: angle between the two orientations. Translation/scale: largest component.
+    static float keyError(ChannelPath path, const glm::vec4& a, const glm::vec4& b) {
+        if (path != ChannelPath::Rotation) {
+            glm::vec3 d = glm::abs(glm::vec3(a) - glm::vec3(b));
+            return glm::max(d.x, glm::max(d.y, d.z));
+        }
+        // chord between the unit quaternions; better conditioned than acos for small angles
+        glm::vec4 qa = glm::normalize(a), qb = glm::normalize(b);
+        if (glm::dot(qa, qb) < 0.0f) qb = -qb;
+        return 4.0f * asinf(glm::min(0.5f * glm::length(qa - qb), 1.0f));
+    }
 
-            glm::vec3 T;
-            glm::vec3 S;
-            glm::quat R;
+    static glm::vec4 sampleKeys(ChannelPath path, const std::vector<float>& times,
+        const std::vector<glm::vec4>& values, float t) {
+        int k = findKeyframeIndex(times, t);
+        float t0 = times[k], t1 = times[k + 1];
+        float factor = glm::clamp((t1 > t0) ? (t - t0) / (t1 - t0) : 0.0f, 0.0f, 1.0f);
+        return interpolateKey(path, values[k], values[k + 1], factor);
+    }
 
-            glm::mat4& M = nodeTransforms[targetNodeIndex];
+    // Drops every key that interpolating its kept neighbours reproduces within the
+    // tolerance of the path, then quantizes what is left: rotations as smallest-three,
+    // translation and scale to 16 bits over the track's own range.
+    void compressSampler(SamplerObject& sampler, ChannelPath path, CompressionReport& report) const {
+        const std::vector<float>& times = sampler.input;
+        const std::vector<glm::vec4>& values = sampler.output;
+        size_t n = times.size();
+        if (n < 2 || values.size() != n || !sampler.packed.empty()) return;
+
+        const float tolerance = path == ChannelPath::Rotation ? ANIM_TOLERANCE_ROTATION
+            : path == ChannelPath::Scale ? ANIM_TOLERANCE_SCALE : ANIM_TOLERANCE_TRANSLATION;
+
+        std::vector<size_t> kept(1, 0);
+        size_t anchor = 0;
+        for (size_t end = 2; end < n; ++end) {
+            bool fits = true;
+            for (size_t m = anchor + 1; m < end && fits; ++m) {
+                float factor = (times[m] - times[anchor]) / (times[end] - times[anchor]);
+                fits = keyError(path, interpolateKey(path, values[anchor], values[end], factor), values[m]) <= tolerance;
+            }
+            if (!fits) {
+                anchor = end - 1;
+                kept.push_back(anchor);
+            }
+        }
+        kept.push_back(n - 1);
+
+        SamplerObject packed;
+        packed.interpolation = sampler.interpolation;
+        packed.path = path;
+        if (path != ChannelPath::Rotation) {
+            glm::vec3 mn(FLT_MAX), mx(-FLT_MAX);
+            for (size_t k : kept) {
+                mn = glm::min(mn, glm::vec3(values[k]));
+                mx = glm::max(mx, glm::vec3(values[k]));
+            }
+            packed.rangeMin = mn;
+            packed.rangeStep = (mx - mn) / 65535.0f;
+        }
+        for (size_t k : kept) {
+            packed.input.push_back(times[k]);
+            uint16_t q[3];
+            if (path == ChannelPath::Rotation) {
+                packQuaternion(values[k], q);
+            }
+            else {
+                for (int c = 0; c < 3; ++c) {
+                    float step = packed.rangeStep[c];
+                    q[c] = step > 0.0f ? (uint16_t)lroundf((values[k][c] - packed.rangeMin[c]) / step) : 0;
+                }
+            }
+            packed.packed.insert(packed.packed.end(), q, q + 3);
+        }
 
-            T = glm::vec3(M[3]);
-            S.x = glm::length(glm::vec3(M[0]));
-            S.y = glm::length(glm::vec3(M[1]));
-            S.z = glm::length(glm::vec3(M[2]));
+        // error of the decoded curve at every original key
+        std::vector<glm::vec4> decoded(kept.size());
+        for (size_t k = 0; k < kept.size(); ++k) decoded[k] = decodeKey(packed, (int)k);
+        float& maxError = report.maxError[(int)path];
+        for (size_t m = 0; m < n; ++m)
+            maxError = glm::max(maxError, keyError(path, sampleKeys(path, packed.input, decoded, times[m]), values[m]));
+
+        report.keysBefore += n;
+        report.keysAfter += kept.size();
+        report.bytesBefore += n * (sizeof(float) + sizeof(glm::vec4));
+        report.bytesAfter += kept.size() * (sizeof(float) + 3 * sizeof(uint16_t)) + 2 * sizeof(glm::vec3);
+
+        sampler.input.swap(packed.input);
+        sampler.packed.swap(packed.packed);
+        std::vector<glm::vec4>().swap(sampler.output);
+        sampler.path = path;
+        sampler.rangeMin = packed.rangeMin;
+        sampler.rangeStep = packed.rangeStep;
+    }
 
-            glm::mat3 rotMat(
-                glm::vec3(M[0]) / (S.x == 0 ? 1.f : S.x),
-                glm::vec3(M[1]) / (S.y == 0 ? 1.f : S.y),
-                glm::vec3(M[2]) / (S.z == 0 ? 1.f : S.z)
-            );
-            R = glm::quat_cast(rotMat);
+    // Applies every channel to the T/R/S lane of its node, then composes the local matrices
+    // of all animated nodes in one batch. cursors, one per sampler, remember where the
+    // previous call of the same instance found its keys; without them every lookup is a
+    // binary search.
+    void updateAnimation(const AnimationObject& animationObject, float time,
+        TRSBatch& trs, std::vector<glm::mat4>& localTransforms, int* cursors) const {
+        for (const ChannelObject& channel : animationObject.channels) {
+            const SamplerObject& sampler = *channel.sampler;
+            const std::vector<float>& times = sampler.input;
+            int keyframeIndex = 0, nextIndex = 0;
+            float factor = 0.0f;
+            if (times.size() >= 2) {
+                float animationTime = fmod(time, times.back());
+                keyframeIndex = cursors ? advanceKeyframeCursor(times, animationTime, cursors[channel.samplerIndex])
+                    : findKeyframeIndex(times, animationTime);
+                nextIndex = glm::min(keyframeIndex + 1, (int)times.size() - 1);
+
+                float t0 = times[keyframeIndex];
+                float t1 = times[nextIndex];
+                factor = (t1 > t0) ? (animationTime - t0) / (t1 - t0) : 0.0f;
+                factor = glm::clamp(factor, 0.0f, 1.0f);
+            }
 
-            if (channel.target_path == "translation") {
-                glm::vec3 v0, v1;
-                memcpy(&v0, outputPtr + keyframeIndex * 3 * sizeof(float), 3 * sizeof(float));
-                memcpy(&v1, outputPtr + nextIndex * 3 * sizeof(float), 3 * sizeof(float));
-                T = glm::mix(v0, v1, factor);
+            int lane = channel.lane;
+            glm::vec4 v0 = decodeKey(sampler, keyframeIndex);
+            glm::vec4 v1 = decodeKey(sampler, nextIndex);
+            switch (channel.path) {
+            case ChannelPath::Translation: {
+                glm::vec3 t = glm::mix(glm::vec3(v0), glm::vec3(v1), factor);
+                trs.tx[lane] = t.x; trs.ty[lane] = t.y; trs.tz[lane] = t.z;
+                break;
             }
-            else if (channel.target_path == "rotation") {
-                glm::quat q0, q1;
-                memcpy(&q0, outputPtr + keyframeIndex * 4 * sizeof(float), 4 * sizeof(float));
-                memcpy(&q1, outputPtr + nextIndex * 4 * sizeof(float), 4 * sizeof(float));
-                q0 = glm::normalize(q0);
-                q1 = glm::normalize(q1);
-                R = glm::normalize(glm::slerp(q0, q1, factor));
+            case ChannelPath::Rotation: {
+                glm::quat q0 = glm::normalize(glm::quat(v0.w, v0.x, v0.y, v0.z));
+                glm::quat q1 = glm::normalize(glm::quat(v1.w, v1.x, v1.y, v1.z));
+                glm::quat q = glm::normalize(glm::slerp(q0, q1, factor));
+                trs.rx[lane] = q.x; trs.ry[lane] = q.y; trs.rz[lane] = q.z; trs.rw[lane] = q.w;
+                break;
+            }
+            case ChannelPath::Scale: {
+                glm::vec3 sc = glm::mix(glm::vec3(v0), glm::vec3(v1), factor);
+                trs.sx[lane] = sc.x; trs.sy[lane] = sc.y; trs.sz[lane] = sc.z;
+                break;
             }
-            else if (channel.target_path == "scale") {
-                glm::vec3 s0, s1;
-                memcpy(&s0, outputPtr + keyframeIndex * 3 * sizeof(float), 3 * sizeof(float));
-                memcpy(&s1, outputPtr + nextIndex * 3 * sizeof(float), 3 * sizeof(float));
-                S = glm::mix(s0, s1, factor);
             }
-
-            M = glm::translate(glm::mat4(1.0f), T) * glm::mat4_cast(R) * glm::scale(glm::mat4(1.0f), S);
         }
+
+        ComposeTRSBatch(trs, localTransforms.data(), animationObject.animatedSlots.data());
     }
 
-    void updateSkinning(const std::vector<glm::mat4>& globalNodeTransforms) {
-        for (size_t i = 0; i < model.skins.size(); ++i) {
-            const tinygltf::Skin& skin = model.skins[i];
-            SkinObject& skinObject = skinObjects[i];
-            for (size_t j = 0; j < skin.joints.size(); ++j) {
-                int jointNodeIndex = skin.joints[j];
-                skinObject.globalJointTransforms[j] = globalNodeTransforms[jointNodeIndex];
-                skinObject.jointMatrices[j] = skinObject.globalJointTransforms[j] * skinObject.inverseBindMatrices[j];
+    void updateSkinning(const std::vector<glm::mat4>& globalTransforms) {
+        if (skinObjects.empty()) return;
+        SkinObject& skinObject = skinObjects[0];
+        for (size_t j = 0; j < jointSlots.size(); ++j)
+            skinObject.globalJointTransforms[j] = globalTransforms[jointSlots[j]];
+        MultiplyMat4Batch(skinObject.globalJointTransforms.data(), nullptr, skinObject.inverseBindMatrices.data(),
+            skinObject.jointMatrices.data(), jointSlots.size());
+    }
+
+    // Skins every vertex once with the shared pose and captures position + normal with
+    // transform feedback; all bot draws in both passes then read the result as a static mesh.
+    void initPreSkinning() {
+        const char* skinVS = R"GLSL(
+            #version 330 core
+            layout(location=0) in vec3 vertexPosition;
+            layout(location=1) in vec3 vertexNormal;
+            layout(location=3) in vec4 vertexJointsFloat;
+            layout(location=4) in vec4 vertexWeights;
+
+            uniform mat4 jointMatrices[100];
+
+            out vec3 tfPosition;
+            out vec3 tfNormal;
+
+            void main() {
+                uvec4 j = uvec4(vertexJointsFloat);
+                mat4 skinMat =
+                    vertexWeights.x * jointMatrices[j.x] +
+                    vertexWeights.y * jointMatrices[j.y] +
+                    vertexWeights.z * jointMatrices[j.z] +
+                    vertexWeights.w * jointMatrices[j.w];
+
+                tfPosition = vec3(skinMat * vec4(vertexPosition, 1.0));
+                tfNormal = mat3(skinMat) * vertexNormal;
             }
+        )GLSL";
+
+        GLuint vs = CompileShader(GL_VERTEX_SHADER, skinVS);
+        skinTFProgramID = glCreateProgram();
+        glAttachShader(skinTFProgramID, vs);
+        const char* varyings[2] = { "tfPosition", "tfNormal" };
+        glTransformFeedbackVaryings(skinTFProgramID, 2, varyings, GL_INTERLEAVED_ATTRIBS);
+        glLinkProgram(skinTFProgramID);
+        glDeleteShader(vs);
+
+        GLint ok = 0;
+        glGetProgramiv(skinTFProgramID, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            std::cerr << "Failed to link bot pre-skinning program.\n";
+            glDeleteProgram(skinTFProgramID);
+            skinTFProgramID = 0;
+            return;
         }
+        skinTFJointsID = glGetUniformLocation(skinTFProgramID, "jointMatrices");
     }
 
-    void update(float time) {
-        if (model.skins.empty()) return;
-
-        std::vector<glm::mat4> localTransforms(model.nodes.size(), glm::mat4(1.0f));
-        const tinygltf::Skin& skin = model.skins[0];
-        int rootIndex = (skin.skeleton >= 0) ? skin.skeleton : skin.joints[0];
+    void preSkin() {
+        if (!skinTFProgramID || skinObjects.empty() || skinObjects[0].jointMatrices.empty()) return;
+        const SkinObject& skin = skinObjects[0];
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        gGL.useProgram(skinTFProgramID);
+        glUniformMatrix4fv(skinTFJointsID, (GLsizei)skin.jointMatrices.size(), GL_FALSE,
+            glm::value_ptr(skin.jointMatrices[0]));
+
+        // the primitives' vertices are contiguous, so one pass covers them all
+        if (skinnedVBO) {
+            gGL.bindVertexArray(vao);
+            glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, skinnedVBO);
+            glBeginTransformFeedback(GL_POINTS);
+            glDrawArrays(GL_POINTS, mesh.baseVertex, mesh.vertexCount);
+            glEndTransformFeedback();
+        }
 
-        computeLocalNodeTransform(model, rootIndex, localTransforms);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        glDisable(GL_RASTERIZER_DISCARD);
+    }
 
-        if (!model.animations.empty() && !animationObjects.empty()) {
-            const tinygltf::Animation& anim = model.animations[0];
-            const AnimationObject& animationObject = animationObjects[0];
-            updateAnimation(model, anim, animationObject, time, localTransforms);
+    // Local then global transforms of the flattened skeleton: one linear pass, since every
+    // parent's slot precedes its children's.
+    void computePoseTransforms(float time, PoseScratch& scratch, int* cursors) const {
+        scratch.localTransforms.assign(restLocalTransforms.begin(), restLocalTransforms.end());
+        if (!animationObjects.empty()) {
+            scratch.trs = animationObjects[0].restPose;
+            updateAnimation(animationObjects[0], time, scratch.trs, scratch.localTransforms, cursors);
         }
 
-        std::vector<glm::mat4> globalTransforms(model.nodes.size(), glm::mat4(1.0f));
-        computeGlobalNodeTransform(model, localTransforms, rootIndex, glm::mat4(1.0f), globalTransforms);
-        updateSkinning(globalTransforms);
+        scratch.globalTransforms.resize(skeletonNodes.size());
+        ConcatenateHierarchy(skeletonParents.data(), scratch.localTransforms.data(), scratch.globalTransforms.data(),
+            skeletonNodes.size());
     }
 
-    bool loadModel(tinygltf::Model& model, const char* filename) {
-        tinygltf::TinyGLTF loader;
-        std::string err, warn;
-        bool res = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
-        if (!res) std::cout << "Failed to load glTF: " << filename << "\n";
-        else std::cout << "Loaded glTF: " << filename << "\n";
-        return res;
+    void update(float time) {
+        if (skinObjects.empty()) return;
+
+        if (!animationObjects.empty()) sharedCursors.resize(animationObjects[0].samplers.size(), 0);
+        computePoseTransforms(time, poseScratch, sharedCursors.empty() ? nullptr : sharedCursors.data());
+        updateSkinning(poseScratch.globalTransforms);
     }
 
-    void bindMesh(std::vector<PrimitiveObject>& primitiveObjects, tinygltf::Model& model, tinygltf::Mesh& mesh) {
-        std::map<int, GLuint> vbos;
+    // Joint palette of skin 0 at the given time. Only reads shared state, so it is safe
+    // to call from worker threads with per-thread scratch and per-instance cursors.
+    void evaluatePalette(float time, PoseScratch& scratch, glm::mat4* palette, int* cursors = nullptr) const {
+        computePoseTransforms(time, scratch, cursors);
+        MultiplyMat4Batch(scratch.globalTransforms.data(), jointSlots.data(), skinObjects[0].inverseBindMatrices.data(),
+            palette, jointSlots.size());
+    }
 
-        for (size_t i = 0; i < model.bufferViews.size(); ++i) {
-            const tinygltf::BufferView& bufferView = model.bufferViews[i];
-            if (bufferView.target == 0) continue;
+    size_t samplerCursorCount() const {
+        return animationObjects.empty() ? 0 : animationObjects[0].samplers.size();
+    }
 
-            const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
-            GLuint vbo;
-            glGenBuffers(1, &vbo);
-            glBindBuffer(bufferView.target, vbo);
-            glBufferData(bufferView.target, bufferView.byteLength,
-                &buffer.data.at(0) + bufferView.byteOffset, GL_STATIC_DRAW);
-            vbos[(int)i] = vbo;
-        }
+    size_t jointCount() const {
+        return skinObjects.empty() ? 0 : skinObjects[0].jointMatrices.size();
+    }
 
-        for (size_t i = 0; i < mesh.primitives.size(); ++i) {
-            tinygltf::Primitive primitive = mesh.primitives[i];
+    void initInstancing() {
+        glGenBuffers(1, &instanceVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        instanceCapacity = 128;
+        glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(BotInstance), nullptr, GL_STREAM_DRAW);
 
-            GLuint vao;
-            glGenVertexArrays(1, &vao);
+        if (vao) {
             glBindVertexArray(vao);
+            for (int c = 0; c < 4; ++c) {
+                glEnableVertexAttribArray(5 + c);
+                glVertexAttribPointer(5 + c, 4, GL_FLOAT, GL_FALSE, sizeof(BotInstance),
+                    BUFFER_OFFSET(offsetof(BotInstance, model) + c * sizeof(glm::vec4)));
+                glVertexAttribDivisor(5 + c, 1);
+            }
+            glEnableVertexAttribArray(9);
+            glVertexAttribIPointer(9, 1, GL_INT, sizeof(BotInstance), BUFFER_OFFSET(offsetof(BotInstance, paletteBase)));
+            glVertexAttribDivisor(9, 1);
+            glEnableVertexAttribArray(10);
+            glVertexAttribPointer(10, 1, GL_FLOAT, GL_FALSE, sizeof(BotInstance), BUFFER_OFFSET(offsetof(BotInstance, animTime)));
+            glVertexAttribDivisor(10, 1);
+        }
+        glBindVertexArray(0);
 
-            for (auto& attrib : primitive.attributes) {
-                tinygltf::Accessor accessor = model.accessors[attrib.second];
-                int byteStride = accessor.ByteStride(model.bufferViews[accessor.bufferView]);
-
-                glBindBuffer(GL_ARRAY_BUFFER, vbos[accessor.bufferView]);
-
-                int size = (accessor.type == TINYGLTF_TYPE_SCALAR) ? 1 : accessor.type;
+        glGenBuffers(1, &paletteTBO);
+        glBindBuffer(GL_TEXTURE_BUFFER, paletteTBO);
+        paletteCapacity = 128 * jointCount();
+        glBufferData(GL_TEXTURE_BUFFER, paletteCapacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
 
-                int vaa = -1;
-                if (attrib.first == "POSITION") vaa = 0;
-                if (attrib.first == "NORMAL")   vaa = 1;
-                if (attrib.first == "TEXCOORD_0") vaa = 2;
-                if (attrib.first == "JOINTS_0") vaa = 3;
-                if (attrib.first == "WEIGHTS_0") vaa = 4;
+        glGenTextures(1, &paletteTex);
+        glBindTexture(GL_TEXTURE_BUFFER, paletteTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, paletteTBO);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
 
-                if (vaa > -1) {
-                    glEnableVertexAttribArray(vaa);
-                    glVertexAttribPointer(vaa, size, accessor.componentType,
-                        accessor.normalized ? GL_TRUE : GL_FALSE,
-                        byteStride, BUFFER_OFFSET(accessor.byteOffset));
+    // Samples the prepareAnimation() output through the same evaluatePalette() the live
+    // path uses, so toggling between the two compares like with like.
+    void bakeAnimation() {
+        size_t jc = jointCount();
+        if (jc == 0 || animationObjects.empty()) return;
+
+        float duration = 0.0f;
+        for (const SamplerObject& sampler : animationObjects[0].samplers)
+            if (!sampler.input.empty()) duration = glm::max(duration, sampler.input.back());
+        if (duration <= 0.0f) return;
+
+        // Frames split [0, duration) evenly, so the loop repeats every duration seconds like
+        // the live path's fmod, and the last frame blends into frame 0 over the remainder.
+        GLint maxTexSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+        bakedFrameCount = glm::clamp((int)ceilf(duration * 30.0f), 2, (int)maxTexSize);
+        bakedFPS = bakedFrameCount / duration;
+
+        std::vector<glm::vec4> rows((size_t)bakedFrameCount * jc * 3);
+        ParallelFor((size_t)bakedFrameCount, 8, [&](size_t begin, size_t end) {
+            PoseScratch scratch;
+            std::vector<glm::mat4> palette(jc);
+            std::vector<int> cursors(samplerCursorCount(), 0);
+            for (size_t f = begin; f < end; ++f) {
+                evaluatePalette(f * duration / bakedFrameCount, scratch, palette.data(), cursors.empty() ? nullptr : cursors.data());
+                glm::vec4* dst = &rows[f * jc * 3];
+                for (size_t j = 0; j < jc; ++j) {
+                    glm::mat4 t = glm::transpose(palette[j]);
+                    dst[j * 3 + 0] = t[0];
+                    dst[j * 3 + 1] = t[1];
+                    dst[j * 3 + 2] = t[2];
                 }
             }
+        });
 
-            PrimitiveObject po;
-            po.vao = vao;
-            po.vbos = vbos;
-            primitiveObjects.push_back(po);
+        glGenTextures(1, &bakedTex);
+        glBindTexture(GL_TEXTURE_2D, bakedTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (GLsizei)(jc * 3), bakedFrameCount, 0, GL_RGBA, GL_FLOAT, rows.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
 
-            glBindVertexArray(0);
+        std::cout << "Baked bot animation: " << bakedFrameCount << " frames at " << bakedFPS << " fps, "
+            << rows.size() * sizeof(glm::vec4) / 1024 << " KiB\n";
+    }
+
+    void bindBakedAnimation(GLint bakedLoc, GLint frameCountLoc, GLint fpsLoc) {
+        glUniform1i(bakedLoc, useBakedAnimation ? 1 : 0);
+        if (!useBakedAnimation) return;
+        gGL.bindTexture(14, bakedTex);
+        glUniform1i(frameCountLoc, bakedFrameCount);
+        glUniform1f(fpsLoc, bakedFPS);
+    }
+
+    void beginInstanceFrame() {
+        ++instanceFrame;
+        lodStats = AnimLodStats();
+    }
+
+    // The bot indices now refer to other tiles, so no kept pose can be reused.
+    void invalidatePalettes() {
+        std::fill(paletteValid.begin(), paletteValid.end(), 0);
+    }
+
+    // Re-evaluates the palettes of the visible bots that are due this frame on the worker
+    // pool and uploads the range they span. A bot is due on the frames its LOD interval
+    // selects, staggered by bot index so each frame takes a similar share; frozen bots
+    // only when they have no pose yet. Calling it again in the same frame (shadow pass,
+    // then camera pass) only picks up bots not seen before.
+    void ensurePalettes(const std::vector<uint8_t>& visible, const std::vector<float>& animTimes,
+        const std::vector<uint8_t>& lods) {
+        size_t jc = jointCount();
+        if (jc == 0) return;
+        size_t n = visible.size();
+        if (paletteValid.size() < n) {
+            paletteValid.resize(n, 0);
+            paletteFrame.resize(n, 0);
+            palettes.resize(n * jc);
+        }
+
+        missingPalettes.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (!visible[i] || paletteFrame[i] == instanceFrame) continue;
+            paletteFrame[i] = instanceFrame;
+
+            int lod = useAnimationLod ? lods[i] : 0;
+            int interval = BOT_ANIM_LOD_INTERVAL[lod];
+            ++lodStats.bots[lod];
+            bool due = !paletteValid[i] || (interval > 0 && (instanceFrame + i) % interval == 0);
+            if (!due) continue;
+
+            ++lodStats.evaluated[lod];
+            paletteValid[i] = 1;
+            missingPalettes.push_back(i);
+        }
+        if (missingPalettes.empty()) return;
+
+        // a bot index may now belong to a different tile; its cursors then just take the
+        // slow path once
+        size_t sc = samplerCursorCount();
+        if (instanceCursors.size() < n * sc) instanceCursors.resize(n * sc, 0);
+
+        ParallelFor(missingPalettes.size(), 4, [&](size_t begin, size_t end) {
+            static thread_local PoseScratch scratch;
+            for (size_t k = begin; k < end; ++k) {
+                size_t i = missingPalettes[k];
+                evaluatePalette(animTimes[i], scratch, &palettes[i * jc],
+                    sc ? &instanceCursors[i * sc] : nullptr);
+            }
+        });
+
+        // missingPalettes is in ascending bot order; each run of consecutive bots is one
+        // upload. With too many runs, re-specifying the whole store is cheaper and orphans
+        // the copy earlier draws still read.
+        size_t runs = 1;
+        for (size_t k = 1; k < missingPalettes.size(); ++k)
+            if (missingPalettes[k] != missingPalettes[k - 1] + 1) ++runs;
+
+        glBindBuffer(GL_TEXTURE_BUFFER, paletteTBO);
+        if (palettes.size() > paletteCapacity || runs > PALETTE_MAX_UPLOAD_RUNS) {
+            paletteCapacity = glm::max(paletteCapacity, palettes.size());
+            glBufferData(GL_TEXTURE_BUFFER, paletteCapacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, palettes.size() * sizeof(glm::mat4), palettes.data());
+        }
+        else {
+            for (size_t k = 0; k < missingPalettes.size();) {
+                size_t end = k + 1;
+                while (end < missingPalettes.size() && missingPalettes[end] == missingPalettes[end - 1] + 1) ++end;
+                size_t first = missingPalettes[k] * jc;
+                size_t last = (missingPalettes[end - 1] + 1) * jc;
+                glBufferSubData(GL_TEXTURE_BUFFER, first * sizeof(glm::mat4), (last - first) * sizeof(glm::mat4),
+                    &palettes[first]);
+                k = end;
+            }
         }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
     }
 
-    void bindModelNodes(std::vector<PrimitiveObject>& primitiveObjects, tinygltf::Model& model, tinygltf::Node& node) {
-        if ((node.mesh >= 0) && (node.mesh < (int)model.meshes.size()))
-            bindMesh(primitiveObjects, model, model.meshes[node.mesh]);
-        for (size_t i = 0; i < node.children.size(); i++)
-            bindModelNodes(primitiveObjects, model, model.nodes[node.children[i]]);
+    // Fills the per-instance buffer with the visible bots, in the order of the bot indices
+    // in order if given. Unless the baked animation is in use, their palettes must already
+    // exist (ensurePalettes).
+    GLsizei uploadInstances(const std::vector<glm::mat4>& models, const std::vector<uint8_t>& visible,
+        const std::vector<float>& animTimes, const std::vector<uint32_t>* order = nullptr) {
+        size_t jc = jointCount();
+        instances.clear();
+        size_t count = order ? order->size() : models.size();
+        for (size_t k = 0; k < count; ++k) {
+            size_t i = order ? (*order)[k] : k;
+            if (!visible[i]) continue;
+            bool hasPalette = i < paletteValid.size() && paletteValid[i];
+            if (!useBakedAnimation && !hasPalette) continue;
+            BotInstance inst;
+            inst.model = models[i];
+            inst.paletteBase = hasPalette ? (GLint)(i * jc) : 0;
+            inst.animTime = animTimes[i];
+            instances.push_back(inst);
+        }
+        if (instances.empty()) return 0;
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        if (instances.size() > instanceCapacity) instanceCapacity = instances.size() * 2;
+        glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(BotInstance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(BotInstance), instances.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return (GLsizei)instances.size();
     }
 
-    std::vector<PrimitiveObject> bindModel(tinygltf::Model& model) {
-        std::vector<PrimitiveObject> primitiveObjects;
-        const tinygltf::Scene& scene = model.scenes[model.defaultScene];
-        for (size_t i = 0; i < scene.nodes.size(); ++i)
-            bindModelNodes(primitiveObjects, model, model.nodes[scene.nodes[i]]);
-        return primitiveObjects;
+    void bindPaletteTexture(GLint samplerLoc, int unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_BUFFER, paletteTex);
+        glUniform1i(samplerLoc, unit);
     }
 
-    void drawMesh(const std::vector<PrimitiveObject>& primitiveObjects, tinygltf::Model& model, tinygltf::Mesh& mesh) {
-        for (size_t i = 0; i < mesh.primitives.size(); ++i) {
-            if (i >= primitiveObjects.size()) return;
+    bool loadModel(tinygltf::Model& model, const char* filename) {
+        tinygltf::TinyGLTF loader;
+        std::string err, warn;
+        bool res = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+        if (!res) std::cout << "Failed to load glTF: " << filename << "\n";
+        else std::cout << "Loaded glTF: " << filename << "\n";
+        return res;
+    }
 
-            GLuint vao = primitiveObjects[i].vao;
-            std::map<int, GLuint> vbos = primitiveObjects[i].vbos;
+    // CPU-side skeleton and animation only; creates no GL objects (used by the benchmarks).
+    bool loadAnimation() {
+        tinygltf::Model model;
+        if (!loadModel(model, BOT_GLTF_PATH)) return false;
+        skinObjects = prepareSkinning(model);
+        animationObjects = prepareAnimation(model);
+        prepareSkeleton(model);
+        return !skinObjects.empty();
+    }
 
-            glBindVertexArray(vao);
+    // Load-time state of compileModel: the converted vertices and indices, each glTF
+    // primitive's slice of the indices, and the meshes in the order the scene draws them.
+    struct PrimitiveSlice {
+        GLenum mode;
+        size_t firstIndex;
+        GLsizei indexCount;
+    };
+    struct ModelBuild {
+        std::vector<SkinnedVertex> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<PrimitiveSlice> primitives;
+        std::vector<int> meshFirstPrimitive;    // -1 until the mesh is converted
+        std::vector<int> meshDrawOrder;
+    };
 
-            tinygltf::Primitive primitive = mesh.primitives[i];
-            tinygltf::Accessor indexAccessor = model.accessors[primitive.indices];
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbos.at(indexAccessor.bufferView));
+    // Appends the mesh's primitives, converted to SkinnedVertex, to the build, each
+    // primitive's indices rebased onto its first vertex. A mesh used by several nodes is
+    // stored once.
+    void compileMesh(const tinygltf::Model& model, int meshIndex, ModelBuild& build) {
+        if (build.meshFirstPrimitive[meshIndex] >= 0) return;
+        build.meshFirstPrimitive[meshIndex] = (int)build.primitives.size();
+
+        std::vector<SkinnedVertex>& vertices = build.vertices;
+        std::vector<uint32_t>& indices = build.indices;
+        for (const tinygltf::Primitive& primitive : model.meshes[meshIndex].primitives) {
+            PrimitiveSlice slice;
+            slice.mode = (GLenum)primitive.mode;
+            slice.firstIndex = indices.size();
+            slice.indexCount = 0;
+
+            auto itPos = primitive.attributes.find("POSITION");
+            if (itPos == primitive.attributes.end()) {
+                build.primitives.push_back(slice);
+                continue;
+            }
+            size_t vertexCount = model.accessors[itPos->second].count;
+            uint32_t base = (uint32_t)vertices.size();
+            vertices.resize(base + vertexCount);
+            for (size_t v = 0; v < vertexCount; ++v) {
+                SkinnedVertex& sv = vertices[base + v];
+                memset(&sv, 0, sizeof(sv));
+                sv.weights[0] = 1.0f;
+            }
 
-            glDrawElements(primitive.mode, (GLsizei)indexAccessor.count,
-                indexAccessor.componentType,
-                BUFFER_OFFSET(indexAccessor.byteOffset));
+            for (auto& attrib : primitive.attributes) {
+                const tinygltf::Accessor& accessor = model.accessors[attrib.second];
+                if (accessor.bufferView < 0) continue;
+                int components = std::min(tinygltf::GetNumComponentsInType(accessor.type), 4);
+                for (size_t v = 0; v < vertexCount && v < accessor.count; ++v) {
+                    SkinnedVertex& sv = vertices[base + v];
+                    for (int c = 0; c < components; ++c) {
+                        float value = readAccessorComponent(model, accessor, v, c);
+                        if (attrib.first == "POSITION" && c < 3) sv.position[c] = value;
+                        else if (attrib.first == "NORMAL" && c < 3) sv.normal[c] = value;
+                        else if (attrib.first == "TEXCOORD_0" && c < 2) sv.uv[c] = value;
+                        else if (attrib.first == "JOINTS_0") sv.joints[c] = (uint16_t)value;
+                        else if (attrib.first == "WEIGHTS_0") sv.weights[c] = value;
+                    }
+                }
+            }
 
-            glBindVertexArray(0);
+            if (primitive.indices >= 0) {
+                const tinygltf::Accessor& indexAccessor = model.accessors[primitive.indices];
+                for (size_t i = 0; i < indexAccessor.count; ++i)
+                    indices.push_back(base + (uint32_t)readAccessorComponent(model, indexAccessor, i, 0));
+            }
+            else {
+                for (size_t i = 0; i < vertexCount; ++i) indices.push_back(base + (uint32_t)i);
+            }
+            slice.indexCount = (GLsizei)(indices.size() - slice.firstIndex);
+            build.primitives.push_back(slice);
         }
     }
 
-    void drawModelNodes(const std::vector<PrimitiveObject>& primitiveObjects, tinygltf::Model& model, tinygltf::Node& node) {
-        if ((node.mesh >= 0) && (node.mesh < (int)model.meshes.size()))
-            drawMesh(primitiveObjects, model, model.meshes[node.mesh]);
+    void compileNodes(const tinygltf::Model& model, const tinygltf::Node& node, ModelBuild& build) {
+        if ((node.mesh >= 0) && (node.mesh < (int)model.meshes.size())) {
+            compileMesh(model, node.mesh, build);
+            build.meshDrawOrder.push_back(node.mesh);
+        }
         for (size_t i = 0; i < node.children.size(); i++)
-            drawModelNodes(primitiveObjects, model, model.nodes[node.children[i]]);
+            compileNodes(model, model.nodes[node.children[i]], build);
     }
 
-    void drawModel(const std::vector<PrimitiveObject>& primitiveObjects, tinygltf::Model& model) {
+    // Uploads every mesh the scene uses as one arena range, sets up the buffer the
+    // pre-skinning pass writes to and flattens the scene into draw commands, one per
+    // primitive per node, in the order the node tree would draw them.
+    void compileModel(const tinygltf::Model& model) {
+        ModelBuild build;
+        build.meshFirstPrimitive.assign(model.meshes.size(), -1);
         const tinygltf::Scene& scene = model.scenes[model.defaultScene];
         for (size_t i = 0; i < scene.nodes.size(); ++i)
-            drawModelNodes(primitiveObjects, model, model.nodes[scene.nodes[i]]);
+            compileNodes(model, model.nodes[scene.nodes[i]], build);
+        if (build.vertices.empty()) return;
+
+        mesh = gGeometry.upload(gFormatSkinned, build.vertices.data(), build.vertices.size(),
+            build.indices.data(), build.indices.size());
+        vao = gGeometry.createVertexArray(gFormatSkinned);
+
+        glGenBuffers(1, &skinnedVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, skinnedVBO);
+        glBufferData(GL_ARRAY_BUFFER, build.vertices.size() * 6 * sizeof(float), nullptr, GL_DYNAMIC_COPY);
+
+        staticVAO = gGeometry.createVertexArray();
+        gGL.bindVertexArray(staticVAO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), BUFFER_OFFSET(3 * sizeof(float)));
+        gGL.bindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // the pre-skinned buffer holds the same vertices from 0
+        drawCommands.clear();
+        preSkinnedCommands.clear();
+        for (int meshIndex : build.meshDrawOrder) {
+            size_t first = (size_t)build.meshFirstPrimitive[meshIndex];
+            for (size_t i = 0; i < model.meshes[meshIndex].primitives.size(); ++i) {
+                const PrimitiveSlice& slice = build.primitives[first + i];
+                if (slice.indexCount == 0) continue;
+                DrawCommand command = { vao, slice.mode, slice.indexCount, mesh.indexType,
+                    mesh.indexByteOffset(slice.firstIndex), mesh.baseVertex };
+                drawCommands.push_back(command);
+                command.vao = staticVAO;
+                command.baseVertex = 0;
+                preSkinnedCommands.push_back(command);
+            }
+        }
+    }
+
+    // instanceCount == 0 issues plain draws; otherwise one instanced draw per command.
+    void drawModel(GLsizei instanceCount = 0) const {
+        bool preSkinned = instanceCount == 0 && usePreSkinning && staticVAO;
+        for (const DrawCommand& c : preSkinned ? preSkinnedCommands : drawCommands) {
+            gGL.bindVertexArray(c.vao);
+            if (instanceCount > 0)
+                glDrawElementsInstancedBaseVertex(c.mode, c.count, c.indexType, BUFFER_OFFSET(c.indexOffset), instanceCount, c.baseVertex);
+            else
+                glDrawElementsBaseVertex(c.mode, c.count, c.indexType, BUFFER_OFFSET(c.indexOffset), c.baseVertex);
+        }
     }
 
+    // The tinygltf model only lives through loading: everything drawn or animated is
+    // compiled out of it into the arena, the draw commands and the skin and animation tables.
     void initialize() {
+        tinygltf::Model model;
         if (!loadModel(model, BOT_GLTF_PATH)) return;
-        primitiveObjects = bindModel(model);
+        optimizeMeshes(model);
+        compileModel(model);
         skinObjects = prepareSkinning(model);
         animationObjects = prepareAnimation(model);
+        prepareSkeleton(model);
+        computeBindPoseBounds(model);
 
-        programID = LoadShadersFromFile(BOT_VERT_PATH, BOT_FRAG_PATH);
+        programID = LoadShadersFromFile(BOT_VERT_PATH, BOT_FRAG_PATH, FRAME_UNIFORMS_GLSL);
         if (programID == 0) std::cerr << "Failed to load bot shaders.\n";
 
+        // camera, fog, light and shadow constants come from the frame uniforms
+        bindFrameUniforms(programID);
         modelID = glGetUniformLocation(programID, "uModel");
+        preSkinnedID = glGetUniformLocation(programID, "uPreSkinned");
+        instancedID = glGetUniformLocation(programID, "uInstanced");
+        palettesID = glGetUniformLocation(programID, "uPalettes");
+        bakedID = glGetUniformLocation(programID, "uBaked");
+        bakedFrameCountID = glGetUniformLocation(programID, "uBakedFrameCount");
+        bakedFPSID = glGetUniformLocation(programID, "uBakedFPS");
+        jointMatricesID = glGetUniformLocation(programID, "jointMatrices");
 
-        cameraPosID = glGetUniformLocation(programID, "cameraPosition");
-        fogColorID = glGetUniformLocation(programID, "fogColor");
-        fogStartID = glGetUniformLocation(programID, "fogStart");
-        fogEndID = glGetUniformLocation(programID, "fogEnd");
+        // fixed texture units; samplers of different types must never share a unit
+        glUseProgram(programID);
+        glUniform1i(glGetUniformLocation(programID, "uShadowMap"), 7);
+        glUniform1i(glGetUniformLocation(programID, "uShadowMapDyn"), 8);
+        for (int i = 0; i < MAX_CASCADES; ++i) {
+            std::string name = "uCascadeMap" + std::to_string(i);
+            glUniform1i(glGetUniformLocation(programID, name.c_str()), 9 + i);
+        }
+        glUniform1i(palettesID, 13);
+        glUniform1i(glGetUniformLocation(programID, "uBakedPalettes"), 14);
+        glUseProgram(0);
 
-        mvpMatrixID = glGetUniformLocation(programID, "MVP");
-        lightPositionID = glGetUniformLocation(programID, "lightPosition");
-        lightIntensityID = glGetUniformLocation(programID, "lightIntensity");
-        jointMatricesID = glGetUniformLocation(programID, "jointMatrices");
+        initPreSkinning();
+        initInstancing();
+        bakeAnimation();
     }
 
-    void render(const glm::mat4& vp, const glm::mat4& modelMatrix) {
-        glUseProgram(programID);
+    // Shadow maps and what the mode (instanced or not) fixes for every bot draw in the
+    // color pass; the camera, fog and light come from the frame uniforms. Called once per
+    // frame before the queue is submitted.
+    void setFrameUniforms(GLStateCache& gl) {
+        if (!programID) return;
+        gl.useProgram(programID);
+
+        gl.bindTexture(7, gShadowTex);
+        gl.bindTexture(8, gShadowDynTex);
+        if (useCascadedShadows) {
+            for (int i = 0; i < MAX_CASCADES; ++i) gl.bindTexture(9 + i, gCascades[i].tex);
+        }
+
+        if (useBotInstancing) {
+            glUniform1i(instancedID, 1);
+            glUniform1i(preSkinnedID, 0);
+            bindPaletteTexture(palettesID, 13);
+            bindBakedAnimation(bakedID, bakedFrameCountID, bakedFPSID);
+            return;
+        }
+        glUniform1i(instancedID, 0);
+        glUniform1i(bakedID, 0);
+        glUniform1i(preSkinnedID, usePreSkinning ? 1 : 0);
+        if (!usePreSkinning && !skinObjects.empty() && (GLint)jointMatricesID >= 0) {
+            const SkinObject& skin = skinObjects[0];
+            if (!skin.jointMatrices.empty()) {
+                glUniformMatrix4fv(jointMatricesID, (GLsizei)skin.jointMatrices.size(), GL_FALSE,
+                    glm::value_ptr(skin.jointMatrices[0]));
+            }
+        }
+    }
 
-        glm::mat4 mvp = vp * modelMatrix;
-        glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, glm::value_ptr(mvp));
+    // Bots queued with queueDraw since the last clearQueued; packets index into it.
+    struct BotDraw {
+        glm::mat4 model;
+        GLuint condition;       // occlusion query to draw under, or 0
+    };
+    std::vector<BotDraw> botDraws;
+    GLsizei queuedInstances = 0;
+
+    void clearQueued() { botDraws.clear(); }
+
+    static void drawPacket(GLStateCache&, void* context, uint32_t item) {
+        MyBot& bot = *static_cast<MyBot*>(context);
+        const BotDraw& draw = bot.botDraws[item];
+        glUniformMatrix4fv(bot.modelID, 1, GL_FALSE, glm::value_ptr(draw.model));
+        if (draw.condition) glBeginConditionalRender(draw.condition, GL_QUERY_BY_REGION_WAIT);
+        bot.drawModel();
+        if (draw.condition) glEndConditionalRender();
+    }
 
-        glUniformMatrix4fv(modelID, 1, GL_FALSE, glm::value_ptr(modelMatrix));
+    // One bot with the shared pose; depth in [0, 1] orders it front to back.
+    void queueDraw(RenderQueue& queue, const glm::mat4& modelMatrix, float depth, GLuint condition) {
+        if (!programID) return;
+        BotDraw draw;
+        draw.model = modelMatrix;
+        draw.condition = condition;
+        botDraws.push_back(draw);
+        DrawPacket packet = { MakeDrawKey(PASS_COLOR, BLEND_NONE, programID, 0, 0, depth),
+            programID, 0, 0, BLEND_NONE, true, true, drawPacket, this, (uint32_t)(botDraws.size() - 1) };
+        queue.push(packet);
+    }
 
-        glUniform3fv(cameraPosID, 1, &eye_center[0]);
+    static void drawInstancedPacket(GLStateCache&, void* context, uint32_t) {
+        MyBot& bot = *static_cast<MyBot*>(context);
+        bot.drawModel(bot.queuedInstances);
+    }
 
-        glm::vec3 fogCol(0.6f, 0.7f, 0.85f);
-        glUniform3fv(fogColorID, 1, &fogCol[0]);
+    // All visible bots in one instanced draw per primitive, each with its own palette.
+    // The instances are uploaded now, in the given order if any.
+    void queueInstanced(RenderQueue& queue, const std::vector<glm::mat4>& models, const std::vector<uint8_t>& visible,
+        const std::vector<float>& animTimes, const std::vector<uint32_t>* order) {
+        queuedInstances = uploadInstances(models, visible, animTimes, order);
+        if (queuedInstances == 0 || !programID) return;
+        DrawPacket packet = { MakeDrawKey(PASS_COLOR, BLEND_NONE, programID, 0, 0, 0.0f),
+            programID, 0, 0, BLEND_NONE, true, true, drawInstancedPacket, this, 0 };
+        queue.push(packet);
+    }
 
-        glUniform1f(fogStartID, 1200.0f);
-        glUniform1f(fogEndID, 6000.0f);
+    void cleanup() {
+        if (programID) glDeleteProgram(programID);
+        if (skinTFProgramID) glDeleteProgram(skinTFProgramID);
+        if (instanceVBO) glDeleteBuffers(1, &instanceVBO);
+        if (paletteTBO) glDeleteBuffers(1, &paletteTBO);
+        if (paletteTex) glDeleteTextures(1, &paletteTex);
+        if (bakedTex) glDeleteTextures(1, &bakedTex);
+        if (skinnedVBO) glDeleteBuffers(1, &skinnedVBO);
+        if (staticVAO) gGeometry.destroyVertexArray(staticVAO);
+        if (vao) gGeometry.destroyVertexArray(vao);
+        gGeometry.release(mesh);
+    }
+};
 
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, gShadowTex);
-        glUniform1i(glGetUniformLocation(programID, "uShadowMap"), 7);
+// Registers the shared vertex formats; attribute locations are the ones the shaders of
+// each format declare. Initial sizes fit what is loaded now, the arena grows past them.
+static void initGeometry() {
+    gGeometry.setStateCache(&gGL);
+
+    VertexLayout position = { 3 * sizeof(float), { { 0, 3, GL_FLOAT, GL_FALSE, 0 } } };
+    gFormatPosition = gGeometry.addFormat(position, 64);
+
+    typedef Cloud::PackedVertex PV;
+    VertexLayout packed = { sizeof(PV), {
+        { 0, 3, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(PV, position) },
+        { 1, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(PV, uv) },
+        { 2, 2, GL_BYTE, GL_TRUE, offsetof(PV, normal) } } };
+    gFormatPackedMesh = gGeometry.addFormat(packed, 1 << 16);
+
+    // joints as unnormalized integers: bot.vert reads them as floats and converts back
+    typedef MyBot::SkinnedVertex SV;
+    VertexLayout skinned = { sizeof(SV), {
+        { 0, 3, GL_FLOAT, GL_FALSE, offsetof(SV, position) },
+        { 1, 3, GL_FLOAT, GL_FALSE, offsetof(SV, normal) },
+        { 2, 2, GL_FLOAT, GL_FALSE, offsetof(SV, uv) },
+        { 3, 4, GL_UNSIGNED_SHORT, GL_FALSE, offsetof(SV, joints) },
+        { 4, 4, GL_FLOAT, GL_FALSE, offsetof(SV, weights) } } };
+    gFormatSkinned = gGeometry.addFormat(skinned, 1 << 14);
+
+    gGeometry.initialize(1 << 20);
+}
 
-        glUniformMatrix4fv(glGetUniformLocation(programID, "uLightVP"), 1, GL_FALSE, glm::value_ptr(gLightVP));
+// Placement of one cloud tile, derived once from hash2i(cx, cz) and reused by both passes.
+struct CloudTile {
+    int cx = INT_MIN, cz = INT_MIN;
+    glm::mat4 cloudM = glm::mat4(1.0f);
+    glm::vec3 cloudCenterWorld = glm::vec3(0.0f);
+    float boundRadius = 0.0f;
+    float cloudScale = 1.0f;
+    float rotY = 0.0f;
+    bool hasBot = false;
+    float phase = 0.0f;
+    float speed = 0.0f;
+    float animOffset = 0.0f;
+    uint8_t lod = 0;        // kept across frames for the LOD hysteresis
+    bool impostor = false;  // likewise
+};
 
-        if (!skinObjects.empty() && (GLint)jointMatricesID >= 0) {
-            const SkinObject& skin = skinObjects[0];
-            if (!skin.jointMatrices.empty()) {
-                glUniformMatrix4fv(jointMatricesID, (GLsizei)skin.jointMatrices.size(), GL_FALSE,
-                    glm::value_ptr(skin.jointMatrices[0]));
+static CloudTile buildCloudTile(int cx, int cz, const Cloud& cloud) {
+    CloudTile tile;
+    tile.cx = cx;
+    tile.cz = cz;
+
+    uint32_t h = hash2i(cx, cz);
+
+    float jitterAmp = CLOUD_SPACING * 0.75f;
+
+    float jx = hashSigned01(h * 747796405u + 2891336453u) * jitterAmp;
+    float jz = hashSigned01(h * 277803737u + 15485863u) * jitterAmp;
+
+    float worldX = cx * CLOUD_SPACING + jx;
+    float worldZ = cz * CLOUD_SPACING + jz;
+
+    float layerPick = hash01(h * 9781u + 6271u);
+    float baseLayer = (layerPick < 0.55f) ? CLOUD_LAYER_LOW : CLOUD_LAYER_HIGH;
+
+    float yJitter = hashSigned01(h * 1597334677u + 3812015801u) * CLOUD_LAYER_BLEND;
+    float cloudY = baseLayer + yJitter;
+
+    float sJitter = hashSigned01(h * 2654435761u + 1013904223u) * CLOUD_SCALE_JITTER;
+    float cloudScale = CLOUD_SCALE * (1.0f + sJitter);
+
+    float rotY = hash01(h * 2246822519u + 3266489917u) * 6.2831853f;
+
+    tile.cloudM =
+        glm::translate(glm::mat4(1.0f), glm::vec3(worldX, cloudY, worldZ)) *
+        glm::rotate(glm::mat4(1.0f), rotY, glm::vec3(0, 1, 0)) *
+        glm::scale(glm::mat4(1.0f), glm::vec3(cloudScale));
+    tile.cloudScale = cloudScale;
+    tile.rotY = rotY;
+
+    glm::vec3 centerOffset = cloud.localCenter * cloudScale;
+    glm::vec3 centerOffsetRot = glm::vec3(
+        cosf(rotY) * centerOffset.x + sinf(rotY) * centerOffset.z,
+        centerOffset.y,
+        -sinf(rotY) * centerOffset.x + cosf(rotY) * centerOffset.z
+    );
+    tile.cloudCenterWorld = glm::vec3(worldX, cloudY, worldZ) + centerOffsetRot;
+    tile.boundRadius = cloud.localRadius * cloudScale;
+
+    float r = hash01(h);
+    tile.hasBot = (r <= BOT_SPAWN_CHANCE);
+    tile.phase = (h & 0xFFFFu) * (1.0f / 65535.0f) * 6.2831853f;
+    tile.speed = 0.7f + 0.6f * hash01(h >> 8);
+    tile.animOffset = hash01(h * 40503u + 2654435769u) * 10.0f;
+
+    return tile;
+}
+
+// Appends the tile's bot placement at time t; ComposeTRSBatch turns the batch into matrices.
+static void pushBotTransformForTile(const CloudTile& tile, float t, TRSBatch& batch) {
+    float runRadius = 2.0f;
+    float ang = t * tile.speed + tile.phase;
+
+    float bx = tile.cloudCenterWorld.x + cosf(ang) * runRadius;
+    float bz = tile.cloudCenterWorld.z + sinf(ang) * runRadius;
+    float by = tile.cloudCenterWorld.y * 0.75f;
+
+    float heading = ang + 1.5707963f;
+
+    batch.push(glm::vec3(bx, by, bz), glm::angleAxis(heading, glm::vec3(0, 1, 0)), glm::vec3(BOT_SCALE));
+}
+
+// Toroidal window of tiles around the camera. A tile (cx, cz) always lives in slot
+// (cx mod side, cz mod side), so when the window moves only the slots whose key
+// no longer matches (the ring that entered view) are rebuilt.
+struct CloudBlock {
+    int cx0, cz0, cx1, cz1;     // tiles covered, clipped to the window, inclusive
+    uint64_t key;               // identifies the block and its clipping
+};
+
+struct CloudTileCache {
+    int radius = 0;
+    int side = 0;
+    int baseX = INT_MIN, baseZ = INT_MIN;
+    std::vector<CloudTile> slots;
+    int tilesBuilt = 0;
+
+    // rebuilt with the window; bounds cover each block's clouds and bots
+    std::vector<CloudBlock> blocks;
+    SphereBatch blockBounds;
+
+    static int wrap(int v, int n) { int m = v % n; return (m < 0) ? m + n : m; }
+    static int floorDiv(int v, int n) { return (v >= 0) ? v / n : -((-v + n - 1) / n); }
+
+    const CloudTile& at(int cx, int cz) const {
+        return slots[wrap(cz, side) * side + wrap(cx, side)];
+    }
+    CloudTile& at(int cx, int cz) {
+        return slots[wrap(cz, side) * side + wrap(cx, side)];
+    }
+    size_t slotIndex(int cx, int cz) const {
+        return (size_t)(wrap(cz, side) * side + wrap(cx, side));
+    }
+
+    // returns true when the tile window moved (or was resized) this frame
+    bool update(const glm::vec3& eye, const Cloud& cloud) {
+        int bx = (int)floorf(eye.x / CLOUD_SPACING);
+        int bz = (int)floorf(eye.z / CLOUD_SPACING);
+        tilesBuilt = 0;
+        if (bx == baseX && bz == baseZ && radius == gCloudRadius && !slots.empty()) return false;
+
+        if (radius != gCloudRadius) {
+            radius = gCloudRadius;
+            side = 2 * radius + 1;
+            slots.assign(side * side, CloudTile());
+        }
+        baseX = bx;
+        baseZ = bz;
+
+        for (int dz = -radius; dz <= radius; ++dz) {
+            for (int dx = -radius; dx <= radius; ++dx) {
+                int cx = baseX + dx;
+                int cz = baseZ + dz;
+                CloudTile& slot = slots[wrap(cz, side) * side + wrap(cx, side)];
+                if (slot.cx == cx && slot.cz == cz) continue;
+                slot = buildCloudTile(cx, cz, cloud);
+                ++tilesBuilt;
+            }
+        }
+        buildBlocks();
+        return true;
+    }
+
+    // Blocks sit on a fixed grid of tile coordinates, so a block keeps its tiles (and
+    // their order) while the window moves, except where the window edge clips it.
+    void buildBlocks() {
+        blocks.clear();
+        blockBounds.clear();
+        int bx0 = floorDiv(baseX - radius, CLOUD_BLOCK_SIZE), bx1 = floorDiv(baseX + radius, CLOUD_BLOCK_SIZE);
+        int bz0 = floorDiv(baseZ - radius, CLOUD_BLOCK_SIZE), bz1 = floorDiv(baseZ + radius, CLOUD_BLOCK_SIZE);
+        for (int bz = bz0; bz <= bz1; ++bz) {
+            for (int bx = bx0; bx <= bx1; ++bx) {
+                CloudBlock block;
+                block.cx0 = glm::max(bx * CLOUD_BLOCK_SIZE, baseX - radius);
+                block.cx1 = glm::min(bx * CLOUD_BLOCK_SIZE + CLOUD_BLOCK_SIZE - 1, baseX + radius);
+                block.cz0 = glm::max(bz * CLOUD_BLOCK_SIZE, baseZ - radius);
+                block.cz1 = glm::min(bz * CLOUD_BLOCK_SIZE + CLOUD_BLOCK_SIZE - 1, baseZ + radius);
+                block.key = ((uint64_t)(block.cx0 & 0xffff) << 48) | ((uint64_t)(block.cx1 & 0xffff) << 32) |
+                    ((uint64_t)(block.cz0 & 0xffff) << 16) | (uint64_t)(block.cz1 & 0xffff);
+
+                glm::vec3 mn(FLT_MAX), mx(-FLT_MAX);
+                for (int cz = block.cz0; cz <= block.cz1; ++cz) {
+                    for (int cx = block.cx0; cx <= block.cx1; ++cx) {
+                        const CloudTile& tile = at(cx, cz);
+                        // bots run a few units around 3/4 of the cloud's height
+                        glm::vec3 botAnchor(tile.cloudCenterWorld.x, tile.cloudCenterWorld.y * 0.75f, tile.cloudCenterWorld.z);
+                        mn = glm::min(glm::min(mn, tile.cloudCenterWorld - tile.boundRadius), botAnchor - 10.0f);
+                        mx = glm::max(glm::max(mx, tile.cloudCenterWorld + tile.boundRadius), botAnchor + 10.0f);
+                    }
+                }
+                blocks.push_back(block);
+                blockBounds.push(0.5f * (mn + mx), 0.5f * glm::length(mx - mn));
+            }
+        }
+    }
+};
+
+static CloudTileCache gCloudTiles;
+
+// Everything in the tile window for one pass, with bounding spheres for culling.
+struct FieldInstances {
+    std::vector<glm::mat4> cloudM;
+    std::vector<uint8_t> cloudLod;
+    std::vector<uint8_t> cloudImpostor;
+    std::vector<float> cloudRotY;
+    SphereBatch cloudBounds;
+    std::vector<uint8_t> cloudVisible;
+
+    TRSBatch botTRS;
+    std::vector<glm::mat4> botM;
+    std::vector<float> botAnimTime;
+    std::vector<uint8_t> botLod;
+    std::vector<uint32_t> botSlot;      // tile slot of each bot, see CloudTileCache::slotIndex
+    SphereBatch botBounds;
+    std::vector<uint8_t> botVisible;
+};
+
+struct CullStats {
+    size_t cloudsTotal = 0, cloudsVisible = 0;
+    size_t botsTotal = 0, botsVisible = 0;
+    size_t cloudCasters = 0, botCasters = 0;
+    size_t cloudTriangles = 0, cloudImpostors = 0;
+    size_t blocksTotal = 0, blocksVisible = 0;
+    size_t botsOccluded = 0, occlusionQueries = 0;
+    size_t cloudFragments = 0;  // samples the blended clouds wrote, a few frames late
+    double sortMicroseconds = 0.0;
+    GLStateCache::Stats gl;     // last frame's
+    unsigned long staticShadowRefreshes = 0;
+    unsigned long cascadeRefreshes = 0;
+};
+
+static FieldInstances gField;
+static CullStats gCullStats;
+static std::vector<glm::mat4> gCloudInstances;
+static std::vector<uint8_t> gCloudInstanceLods;
+static std::vector<Cloud::ImpostorInstance> gCloudImpostors;
+static std::vector<uint8_t> gBlockCloudVisible, gBlockBotVisible;
+static std::vector<uint64_t> gBotBlockKeys, gLastBotBlockKeys;
+
+// The tile's projected size sets how many pixels a model unit covers; the tile moves
+// between levels with CLOUD_LOD_HYSTERESIS around CLOUD_LOD_PIXEL_ERROR.
+static uint8_t selectCloudLod(const Cloud& cloud, const CloudTile& tile) {
+    if (!useCloudLod || cloud.lods.empty()) return 0;
+
+    float distance = glm::max(glm::length(tile.cloudCenterWorld - eye_center) - tile.boundRadius, zNear);
+    float pixelsPerUnit = tile.cloudScale * windowHeight * 0.5f / (distance * tanf(glm::radians(FoV) * 0.5f));
+
+    int lod = glm::min((int)tile.lod, CLOUD_LODS - 1);
+    while (lod > 0 && cloud.lods[lod].error * pixelsPerUnit > CLOUD_LOD_PIXEL_ERROR * (1.0f + CLOUD_LOD_HYSTERESIS))
+        --lod;
+    while (lod + 1 < CLOUD_LODS &&
+        cloud.lods[lod + 1].error * pixelsPerUnit <= CLOUD_LOD_PIXEL_ERROR * (1.0f - CLOUD_LOD_HYSTERESIS))
+        ++lod;
+    return (uint8_t)lod;
+}
+
+// Shadows only need the silhouette: one level coarser than the tile is drawn with, the
+// coarsest drawn level falling through to the shadow-only one.
+static uint8_t cloudShadowLod(uint8_t lod) {
+    return useCloudLod ? (uint8_t)glm::min((int)lod + 1, CLOUD_LODS) : 0;
+}
+
+static bool selectCloudImpostor(const Cloud& cloud, const CloudTile& tile) {
+    if (!useCloudImpostors || !cloud.impostorColorTex) return false;
+    float distance = glm::length(tile.cloudCenterWorld - eye_center);
+    float hysteresis = tile.impostor ? -CLOUD_IMPOSTOR_HYSTERESIS : CLOUD_IMPOSTOR_HYSTERESIS;
+    return distance > CLOUD_IMPOSTOR_DISTANCE * (1.0f + hysteresis);
+}
+
+// Blocks are culled first: clouds against frustum (if any) and maxDistance (if not
+// negative), bots by distance to the fog only. The bot set does not depend on the pass,
+// so every pass of a frame agrees on which bot owns which palette slot; when it changes
+// the palettes are dropped.
+static void gatherCloudField(const Cloud& cloud, MyBot& bot, float t, FieldInstances& field,
+    const Frustum* frustum, float maxDistance) {
+    field.cloudM.clear();
+    field.cloudLod.clear();
+    field.cloudImpostor.clear();
+    field.cloudRotY.clear();
+    field.cloudBounds.clear();
+    field.botTRS.clear();
+    field.botAnimTime.clear();
+    field.botLod.clear();
+    field.botSlot.clear();
+    field.botBounds.clear();
+
+    const SphereBatch& bounds = gCloudTiles.blockBounds;
+    if (frustum) CullSpheres(*frustum, bounds, eye_center, maxDistance, gBlockCloudVisible);
+    else if (maxDistance >= 0.0f) CullSpheresByDistance(bounds, eye_center, maxDistance, gBlockCloudVisible);
+    else gBlockCloudVisible.assign(bounds.size(), 1);
+    if (useFrustumCulling) CullSpheresByDistance(bounds, eye_center, FOG_END, gBlockBotVisible);
+    else gBlockBotVisible.assign(bounds.size(), 1);
+
+    gBotBlockKeys.clear();
+    gCullStats.blocksTotal = gCloudTiles.blocks.size();
+    gCullStats.blocksVisible = 0;
+    for (size_t b = 0; b < gCloudTiles.blocks.size(); ++b) {
+        bool clouds = gBlockCloudVisible[b] != 0, bots = gBlockBotVisible[b] != 0;
+        if (!clouds && !bots) continue;
+        const CloudBlock& block = gCloudTiles.blocks[b];
+        gCullStats.blocksVisible += clouds;
+        if (bots) gBotBlockKeys.push_back(block.key);
+
+        // a block whose nearest point is past the impostor distance is all impostors at
+        // the coarsest level (which its shadows use)
+        float nearest = glm::length(glm::vec3(bounds.x[b], bounds.y[b], bounds.z[b]) - eye_center) - bounds.r[b];
+        bool allImpostors = useCloudImpostors && cloud.impostorColorTex &&
+            nearest > CLOUD_IMPOSTOR_DISTANCE * (1.0f + CLOUD_IMPOSTOR_HYSTERESIS);
+
+        for (int cz = block.cz0; cz <= block.cz1; ++cz) {
+            for (int cx = block.cx0; cx <= block.cx1; ++cx) {
+                CloudTile& tile = gCloudTiles.at(cx, cz);
+
+                if (clouds) {
+                    if (allImpostors) {
+                        tile.impostor = true;
+                        tile.lod = CLOUD_LODS - 1;
+                    }
+                    else {
+                        tile.impostor = selectCloudImpostor(cloud, tile);
+                        tile.lod = selectCloudLod(cloud, tile);
+                    }
+                    field.cloudM.push_back(tile.cloudM);
+                    field.cloudLod.push_back(tile.lod);
+                    field.cloudImpostor.push_back(tile.impostor);
+                    field.cloudRotY.push_back(tile.rotY);
+                    field.cloudBounds.push(tile.cloudCenterWorld, tile.boundRadius);
+                }
+
+                if (!bots || !tile.hasBot) continue;
+
+                pushBotTransformForTile(tile, t, field.botTRS);
+                field.botAnimTime.push_back(gAnimTime + tile.animOffset);
+                field.botSlot.push_back((uint32_t)gCloudTiles.slotIndex(cx, cz));
             }
         }
+    }
+    if (gBotBlockKeys != gLastBotBlockKeys) {
+        bot.invalidatePalettes();
+        gLastBotBlockKeys.swap(gBotBlockKeys);
+    }
 
-        glUniform3fv(lightPositionID, 1, &lightPosition[0]);
-        glUniform3fv(lightIntensityID, 1, &lightIntensity[0]);
+    field.botM.resize(field.botTRS.size());
+    ComposeTRSBatch(field.botTRS, field.botM.data());
+    for (const glm::mat4& botM : field.botM) {
+        glm::vec3 botCenter(botM * glm::vec4(bot.boundCenter, 1.0f));
+        field.botBounds.push(botCenter, bot.boundRadius * BOT_SCALE);
 
-        drawModel(primitiveObjects, model);
+        float distance = glm::length(botCenter - eye_center);
+        uint8_t lod = 0;
+        while (lod < BOT_ANIM_LODS - 1 && distance > BOT_ANIM_LOD_DISTANCE[lod]) ++lod;
+        field.botLod.push_back(lod);
     }
 
-    void cleanup() { if (programID) glDeleteProgram(programID); }
+    field.cloudVisible.assign(field.cloudM.size(), 1);
+    field.botVisible.assign(field.botM.size(), 1);
+}
+
+// Occlusion query state of the bot in each tile slot. A slot is reset when its tile
+// changes, so a result still in flight for the previous tile is never applied.
+struct BotOcclusion {
+    GLuint query = 0;
+    int cx = INT_MIN, cz = INT_MIN;
+    bool pending = false;       // issued, result not read back yet
+    bool occluded = false;      // last result read back
 };
 
-static void renderCloudField(const glm::mat4& vp, Cloud& cloud, MyBot& bot, float t) {
-    int baseX = (int)floorf(eye_center.x / CLOUD_SPACING);
-    int baseZ = (int)floorf(eye_center.z / CLOUD_SPACING);
+static std::vector<BotOcclusion> gBotOcclusion;
+static std::vector<uint8_t> gBotQueried, gBotFrustumVisible;
+static GLuint gOccluderProg = 0, gOcclusionBoxProg = 0;
+static GLint gOcclusionBox_uBox = -1;
+static GLuint gOcclusionBoxVAO = 0, gOcclusionBoxVBO = 0, gOcclusionBoxEBO = 0;
 
-    for (int dz = -CLOUD_RADIUS; dz <= CLOUD_RADIUS; ++dz) {
-        for (int dx = -CLOUD_RADIUS; dx <= CLOUD_RADIUS; ++dx) {
-            int cx = baseX + dx;
-            int cz = baseZ + dz;
+static void initOcclusionCulling() {
+    const char* occluderVS = R"GLSL(
+        #version 330 core
+        layout(location=0) in vec3 aPos;
+        layout(location=1) in vec2 aUV;
+        layout(location=3) in mat4 iModel;
+        out vec2 vUV;
+        void main() {
+            vUV = aUV;
+            gl_Position = uViewProj * iModel * vec4(aPos, 1.0);
+        }
+    )GLSL";
 
-            uint32_t h = hash2i(cx, cz);
+    const char* occluderFS = R"GLSL(
+        #version 330 core
+        in vec2 vUV;
+        uniform sampler2D uColor;
+        uniform float uAlphaCutoff;
+        void main() {
+            if (texture(uColor, vUV).a < uAlphaCutoff) discard;
+        }
+    )GLSL";
 
-            float jitterAmp = CLOUD_SPACING * 0.75f; 
+    const char* boxVS = R"GLSL(
+        #version 330 core
+        layout(location=0) in vec3 aPos;
+        uniform vec4 uBox;      // center, half extent
+        void main() {
+            gl_Position = uViewProj * vec4(uBox.xyz + aPos * uBox.w, 1.0);
+        }
+    )GLSL";
 
-            float jx = hashSigned01(h * 747796405u + 2891336453u) * jitterAmp;
-            float jz = hashSigned01(h * 277803737u + 15485863u) * jitterAmp;
+    const char* boxFS = R"GLSL(
+        #version 330 core
+        void main() { }
+    )GLSL";
 
-            float worldX = cx * CLOUD_SPACING + jx;
-            float worldZ = cz * CLOUD_SPACING + jz;
+    gOccluderProg = LinkProgram(CompileShader(GL_VERTEX_SHADER, occluderVS, FRAME_UNIFORMS_GLSL),
+        CompileShader(GL_FRAGMENT_SHADER, occluderFS));
+    bindFrameUniforms(gOccluderProg);
+    glUseProgram(gOccluderProg);
+    glUniform1i(glGetUniformLocation(gOccluderProg, "uColor"), 0);
+    glUniform1f(glGetUniformLocation(gOccluderProg, "uAlphaCutoff"), CLOUD_OCCLUDER_ALPHA);
+    glUseProgram(0);
+
+    gOcclusionBoxProg = LinkProgram(CompileShader(GL_VERTEX_SHADER, boxVS, FRAME_UNIFORMS_GLSL),
+        CompileShader(GL_FRAGMENT_SHADER, boxFS));
+    bindFrameUniforms(gOcclusionBoxProg);
+    gOcclusionBox_uBox = glGetUniformLocation(gOcclusionBoxProg, "uBox");
+
+    const float corners[8 * 3] = {
+        -1, -1, -1,   1, -1, -1,   1,  1, -1,  -1,  1, -1,
+        -1, -1,  1,   1, -1,  1,   1,  1,  1,  -1,  1,  1,
+    };
+    const GLubyte faces[36] = {
+        0, 2, 1, 0, 3, 2,   4, 5, 6, 4, 6, 7,   0, 1, 5, 0, 5, 4,
+        3, 6, 2, 3, 7, 6,   0, 4, 7, 0, 7, 3,   1, 2, 6, 1, 6, 5,
+    };
+    glGenVertexArrays(1, &gOcclusionBoxVAO);
+    glBindVertexArray(gOcclusionBoxVAO);
+    glGenBuffers(1, &gOcclusionBoxVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, gOcclusionBoxVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glGenBuffers(1, &gOcclusionBoxEBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gOcclusionBoxEBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(faces), faces, GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-            float layerPick = hash01(h * 9781u + 6271u);
-            float baseLayer = (layerPick < 0.55f) ? CLOUD_LAYER_LOW : CLOUD_LAYER_HIGH;
+// Bounding cube of the bot's sphere; the camera inside it (or close enough for the near
+// plane to cut it) would make the query miss, so such bots count as visible.
+static bool botBoxContainsEye(const SphereBatch& bounds, size_t i) {
+    glm::vec3 d = glm::abs(glm::vec3(bounds.x[i], bounds.y[i], bounds.z[i]) - eye_center);
+    return glm::max(glm::max(d.x, d.y), d.z) < bounds.r[i] + 2.0f * zNear;
+}
 
-            float yJitter = hashSigned01(h * 1597334677u + 3812015801u) * CLOUD_LAYER_BLEND;
-            float cloudY = baseLayer + yJitter;
+// Reads back the results that have arrived and, for instanced bots, drops the bots they
+// show to be hidden from field.botVisible. Bots outside the frustum forget their result,
+// so they are drawn again the frame they come back.
+static void resolveBotOcclusion(FieldInstances& field) {
+    gCullStats.botsOccluded = 0;
+    if (gBotOcclusion.size() < gCloudTiles.slots.size()) gBotOcclusion.resize(gCloudTiles.slots.size());
+    for (size_t i = 0; i < field.botM.size(); ++i) {
+        BotOcclusion& o = gBotOcclusion[field.botSlot[i]];
+        const CloudTile& tile = gCloudTiles.slots[field.botSlot[i]];
+        if (o.cx != tile.cx || o.cz != tile.cz) {
+            o.cx = tile.cx;
+            o.cz = tile.cz;
+            o.pending = false;
+            o.occluded = false;
+        }
+        if (!field.botVisible[i] || botBoxContainsEye(field.botBounds, i)) {
+            o.occluded = false;
+            continue;
+        }
+        if (o.pending) {
+            GLuint available = 0;
+            glGetQueryObjectuiv(o.query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint anySamples = 0;
+                glGetQueryObjectuiv(o.query, GL_QUERY_RESULT, &anySamples);
+                o.occluded = anySamples == 0;
+                o.pending = false;
+            }
+        }
+        if (o.occluded) {
+            ++gCullStats.botsOccluded;
+            if (useBotInstancing) field.botVisible[i] = 0;
+        }
+    }
+}
 
-            float sJitter = hashSigned01(h * 2654435761u + 1013904223u) * CLOUD_SCALE_JITTER;
-            float cloudScale = CLOUD_SCALE * (1.0f + sJitter);
+// Draws the visible cloud meshes as occluders, issues the bot queries against them and
+// clears the depth again, so the image itself is unchanged. Instanced bots are queried
+// again once their previous result is back; single bots every frame, since their draw
+// waits on the query. Returns the number of queries issued; gBotQueried marks the bots.
+static size_t issueBotOcclusionQueries(Cloud& cloud, const FieldInstances& field,
+    const std::vector<uint8_t>& frustumVisible) {
+    gBotQueried.assign(field.botM.size(), 0);
+    size_t queries = 0;
+    for (size_t i = 0; i < field.botM.size(); ++i) {
+        if (!frustumVisible[i] || botBoxContainsEye(field.botBounds, i)) continue;
+        if (useBotInstancing && gBotOcclusion[field.botSlot[i]].pending) continue;
+        gBotQueried[i] = 1;
+        ++queries;
+    }
+    if (queries == 0 || !cloud.vao || !cloud.colorTex) return 0;
+
+    gCloudInstances.clear();
+    gCloudInstanceLods.clear();
+    for (size_t i = 0; i < field.cloudM.size(); ++i) {
+        if (!field.cloudVisible[i] || field.cloudImpostor[i]) continue;
+        gCloudInstances.push_back(field.cloudM[i]);
+        gCloudInstanceLods.push_back(field.cloudLod[i]);
+    }
 
-            float rotY = hash01(h * 2246822519u + 3266489917u) * 6.2831853f;
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    gGL.setCullFace(false);
+    if (!gCloudInstances.empty()) {
+        cloud.uploadInstances(gCloudInstances, gCloudInstanceLods);
+        gGL.useProgram(gOccluderProg);
+        gGL.bindTexture(0, cloud.colorTex);
+        gGL.bindVertexArray(cloud.vao);
+        cloud.drawInstances();
+    }
 
-            glm::mat4 cloudM =
-                glm::translate(glm::mat4(1.0f), glm::vec3(worldX, cloudY, worldZ)) *
-                glm::rotate(glm::mat4(1.0f), rotY, glm::vec3(0, 1, 0)) *
-                glm::scale(glm::mat4(1.0f), glm::vec3(cloudScale));
+    gGL.setDepthMask(false);
+    gGL.useProgram(gOcclusionBoxProg);
+    gGL.bindVertexArray(gOcclusionBoxVAO);
+    const SphereBatch& b = field.botBounds;
+    for (size_t i = 0; i < field.botM.size(); ++i) {
+        if (!gBotQueried[i]) continue;
+        BotOcclusion& o = gBotOcclusion[field.botSlot[i]];
+        if (!o.query) glGenQueries(1, &o.query);
+        glUniform4f(gOcclusionBox_uBox, b.x[i], b.y[i], b.z[i], b.r[i]);
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, o.query);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, (void*)0);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        o.pending = true;
+    }
+    gGL.setDepthMask(true);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    gGL.setCullFace(true);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    return queries;
+}
 
-            cloud.render(vp, cloudM);
+// Weighted blended OIT targets: color * weight with the revealage in alpha, and the
+// summed weights. Both take the same blend function (BLEND_WEIGHTED_OIT), since GL 3.3
+// has no per-target blending. The depth attachment gets a copy of the opaque depth every
+// frame, so its format has to match the window's (24/8, requested at startup).
+static GLuint gOITFBO = 0, gOITAccumTex = 0, gOITWeightTex = 0, gOITDepthTex = 0;
+static GLuint gOITCompositeProg = 0, gOITCompositeVAO = 0;
 
-            float r = hash01(h);
-            if (r > BOT_SPAWN_CHANCE) continue;
+static GLuint createScreenTexture(GLint internalFormat, GLenum format, GLenum type) {
+    GLuint tex = 0;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, windowWidth, windowHeight, 0, format, type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return tex;
+}
 
-            float phase = (h & 0xFFFFu) * (1.0f / 65535.0f) * 6.2831853f;
-            float speed = 0.7f + 0.6f * hash01(h >> 8);
+static void initWeightedOIT() {
+    const char* compositeVS = R"GLSL(
+        #version 330 core
+        void main() {
+            vec2 p = vec2(float(gl_VertexID & 1) * 4.0 - 1.0, float(gl_VertexID & 2) * 2.0 - 1.0);
+            gl_Position = vec4(p, 0.0, 1.0);
+        }
+    )GLSL";
 
-            glm::vec3 centerLocal = cloud.localCenter;
-            glm::vec3 centerOffset = glm::vec3(
-                centerLocal.x * cloudScale,
-                centerLocal.y * cloudScale,
-                centerLocal.z * cloudScale
-            );
+    const char* compositeFS = R"GLSL(
+        #version 330 core
+        uniform sampler2D uAccum;
+        uniform sampler2D uWeight;
+        out vec4 FragColor;
+        void main() {
+            ivec2 p = ivec2(gl_FragCoord.xy);
+            vec4 accum = texelFetch(uAccum, p, 0);
+            if (accum.a >= 1.0) discard;
+            vec3 average = accum.rgb / max(texelFetch(uWeight, p, 0).r, 1e-5);
+            FragColor = vec4(average, 1.0 - accum.a);
+        }
+    )GLSL";
 
-            glm::vec3 centerOffsetRot = glm::vec3(
-                cosf(rotY) * centerOffset.x + sinf(rotY) * centerOffset.z,
-                centerOffset.y,
-                -sinf(rotY) * centerOffset.x + cosf(rotY) * centerOffset.z
-            );
+    gOITCompositeProg = LinkProgram(CompileShader(GL_VERTEX_SHADER, compositeVS), CompileShader(GL_FRAGMENT_SHADER, compositeFS));
+    glUseProgram(gOITCompositeProg);
+    glUniform1i(glGetUniformLocation(gOITCompositeProg, "uAccum"), 0);
+    glUniform1i(glGetUniformLocation(gOITCompositeProg, "uWeight"), 1);
+    glUseProgram(0);
+    glGenVertexArrays(1, &gOITCompositeVAO);
+
+    gOITAccumTex = createScreenTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+    gOITWeightTex = createScreenTexture(GL_R16F, GL_RED, GL_FLOAT);
+    gOITDepthTex = createScreenTexture(GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &gOITFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOITFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gOITAccumTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gOITWeightTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, gOITDepthTex, 0);
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "OIT FBO not complete!\n";
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Copies the opaque depth over and clears the targets: no color, full revealage.
+static void beginWeightedOIT() {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gOITFBO);
+    glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOITFBO);
+    const GLfloat accumClear[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    const GLfloat weightClear[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    glClearBufferfv(GL_COLOR, 0, accumClear);
+    glClearBufferfv(GL_COLOR, 1, weightClear);
+}
+
+// Resolves the weighted average over the opaque image with one full-screen triangle.
+static void compositeWeightedOIT() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDisable(GL_DEPTH_TEST);
+    gGL.useProgram(gOITCompositeProg);
+    gGL.bindTexture(0, gOITAccumTex);
+    gGL.bindTexture(1, gOITWeightTex);
+    gGL.setBlend(BLEND_ALPHA);
+    gGL.bindVertexArray(gOITCompositeVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    gGL.setBlend(BLEND_NONE);
+    glEnable(GL_DEPTH_TEST);
+}
 
-            glm::vec3 cloudCenterWorld = glm::vec3(worldX, cloudY, worldZ) + centerOffsetRot;
+// GL_SAMPLES_PASSED over the blended clouds, one query per frame in a small ring; a
+// query is reissued only once its result is in, so reading it never waits.
+static const int FRAGMENT_QUERY_FRAMES = 4;
+static GLuint gFragmentQueries[FRAGMENT_QUERY_FRAMES] = {};
+static bool gFragmentQueryPending[FRAGMENT_QUERY_FRAMES] = {};
+
+static bool beginCloudFragmentQuery() {
+    int slot = (int)(gFrameIndex % FRAGMENT_QUERY_FRAMES);
+    GLuint& query = gFragmentQueries[slot];
+    if (!query) {
+        glGenQueries(1, &query);
+    }
+    else if (gFragmentQueryPending[slot]) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return false;
+        GLuint samples = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samples);
+        gCullStats.cloudFragments = samples;
+    }
+    glBeginQuery(GL_SAMPLES_PASSED, query);
+    gFragmentQueryPending[slot] = true;
+    return true;
+}
 
-            float runRadius = 2.0f; 
-            float ang = t * speed + phase;
+static std::vector<uint32_t> gSortKeys, gSortOrder, gSortedItems;
+static std::vector<uint64_t> gSortScratch;
+static std::vector<uint32_t> gCloudMeshItems, gCloudImpostorItems, gBotOrder;
+
+// Reorders items (indices into bounds) by the view depth of their sphere centers and
+// adds the time it took to gCullStats.sortMicroseconds.
+static void sortByViewDepth(const SphereBatch& bounds, std::vector<uint32_t>& items, bool backToFront) {
+    auto start = std::chrono::high_resolution_clock::now();
+    glm::vec3 forward = glm::normalize(lookat - eye_center);
+    gSortKeys.resize(items.size());
+    for (size_t k = 0; k < items.size(); ++k) {
+        uint32_t i = items[k];
+        float depth = glm::dot(glm::vec3(bounds.x[i], bounds.y[i], bounds.z[i]) - eye_center, forward);
+        uint32_t key = FloatSortKey(depth);
+        gSortKeys[k] = backToFront ? ~key : key;
+    }
+    RadixSortIndices(gSortKeys.data(), gSortKeys.size(), gSortOrder, gSortScratch);
+    gSortedItems.resize(items.size());
+    for (size_t k = 0; k < items.size(); ++k) gSortedItems[k] = items[gSortOrder[k]];
+    items.swap(gSortedItems);
+    gCullStats.sortMicroseconds += std::chrono::duration<double, std::micro>(
+        std::chrono::high_resolution_clock::now() - start).count();
+}
 
-            float bx = cloudCenterWorld.x + cosf(ang) * runRadius;
-            float bz = cloudCenterWorld.z + sinf(ang) * runRadius;
+static void renderCloudField(const glm::mat4& vp, Cloud& cloud, MyBot& bot, float t) {
+    Frustum frustum = ExtractFrustumPlanes(vp);
+    if (useFrustumCulling) gatherCloudField(cloud, bot, t, gField, &frustum, FOG_END);
+    else gatherCloudField(cloud, bot, t, gField, nullptr, -1.0f);
+
+    gCullStats.cloudsTotal = gCloudTiles.slots.size();
+    gCullStats.cloudsVisible = gField.cloudM.size();
+    gCullStats.botsTotal = gCullStats.botsVisible = gField.botM.size();
+    if (useFrustumCulling) {
+        gCullStats.cloudsVisible = CullSpheres(frustum, gField.cloudBounds, eye_center, FOG_END, gField.cloudVisible);
+        gCullStats.botsVisible = CullSpheres(frustum, gField.botBounds, eye_center, FOG_END, gField.botVisible);
+    }
 
-            float by = cloudCenterWorld.y * 0.75f;
+    bool occlusion = useOcclusionCulling && !gField.botM.empty();
+    gCullStats.botsOccluded = gCullStats.occlusionQueries = 0;
+    if (occlusion) {
+        gBotFrustumVisible = gField.botVisible;
+        resolveBotOcclusion(gField);
+        gCullStats.occlusionQueries = issueBotOcclusionQueries(cloud, gField, gBotFrustumVisible);
+    }
 
-            float heading = ang + 1.5707963f;
+    // Blended clouds need back to front; with OIT their order does not matter, but the
+    // opaque bots still go front to back so early depth rejects what they hide.
+    bool sortClouds = useDepthSorting && !useWeightedOIT;
+    gCullStats.sortMicroseconds = 0.0;
+
+    // Opaque bots sort before the blended clouds, which keeps the blend correct; the
+    // clouds go back to front, impostors (all further away than any mesh) first.
+    gRenderQueue.clear();
+    bot.clearQueued();
+    cloud.clearQueued();
+    if (useBotInstancing) {
+        if (!useBakedAnimation) bot.ensurePalettes(gField.botVisible, gField.botAnimTime, gField.botLod);
+        const std::vector<uint32_t>* order = nullptr;
+        if (useDepthSorting) {
+            gBotOrder.clear();
+            for (size_t i = 0; i < gField.botM.size(); ++i)
+                if (gField.botVisible[i]) gBotOrder.push_back((uint32_t)i);
+            sortByViewDepth(gField.botBounds, gBotOrder, false);
+            order = &gBotOrder;
+        }
+        bot.queueInstanced(gRenderQueue, gField.botM, gField.botVisible, gField.botAnimTime, order);
+    }
+    else {
+        const SphereBatch& b = gField.botBounds;
+        for (size_t i = 0; i < gField.botM.size(); ++i) {
+            if (!gField.botVisible[i]) continue;
+            GLuint condition = (occlusion && gBotQueried[i]) ? gBotOcclusion[gField.botSlot[i]].query : 0;
+            float depth = glm::length(glm::vec3(b.x[i], b.y[i], b.z[i]) - eye_center) / zFar;
+            bot.queueDraw(gRenderQueue, gField.botM[i], useDepthSorting ? depth : 0.0f, condition);
+        }
+    }
 
-            glm::mat4 botM =
-                glm::translate(glm::mat4(1.0f), glm::vec3(bx, by, bz)) *
-                glm::rotate(glm::mat4(1.0f), heading, glm::vec3(0, 1, 0)) *
-                glm::scale(glm::mat4(1.0f), glm::vec3(BOT_SCALE));
+    gCloudMeshItems.clear();
+    gCloudImpostorItems.clear();
+    gCullStats.cloudTriangles = 0;
+    for (size_t i = 0; i < gField.cloudM.size(); ++i) {
+        if (!gField.cloudVisible[i]) continue;
+        if (gField.cloudImpostor[i]) {
+            gCloudImpostorItems.push_back((uint32_t)i);
+            gCullStats.cloudTriangles += 2;
+            continue;
+        }
+        if (!cloud.lods.empty()) gCullStats.cloudTriangles += cloud.lods[gField.cloudLod[i]].indexCount / 3;
+        gCloudMeshItems.push_back((uint32_t)i);
+    }
+    if (sortClouds) {
+        sortByViewDepth(gField.cloudBounds, gCloudImpostorItems, true);
+        if (useCloudInstancing) sortByViewDepth(gField.cloudBounds, gCloudMeshItems, true);
+    }
 
-            bot.render(vp, botM);
+    const SphereBatch& b = gField.cloudBounds;
+    gCloudImpostors.clear();
+    for (uint32_t i : gCloudImpostorItems) {
+        Cloud::ImpostorInstance impostor = { glm::vec4(b.x[i], b.y[i], b.z[i], b.r[i]), gField.cloudRotY[i], { 0.0f, 0.0f, 0.0f } };
+        gCloudImpostors.push_back(impostor);
+    }
+    gCullStats.cloudImpostors = gCloudImpostors.size();
+    cloud.queueImpostors(gRenderQueue, gCloudImpostors, 1.0f);
+
+    gCloudInstances.clear();
+    gCloudInstanceLods.clear();
+    for (uint32_t i : gCloudMeshItems) {
+        if (useCloudInstancing) {
+            gCloudInstances.push_back(gField.cloudM[i]);
+            gCloudInstanceLods.push_back(gField.cloudLod[i]);
+            continue;
         }
+        // the queue orders these by their depth
+        float depth = sortClouds ? glm::length(glm::vec3(b.x[i], b.y[i], b.z[i]) - eye_center) / zFar : 0.0f;
+        cloud.queueMesh(gRenderQueue, gField.cloudM[i], gField.cloudLod[i], depth);
     }
+    if (useCloudInstancing) cloud.queueInstanced(gRenderQueue, gCloudInstances, gCloudInstanceLods, 0.0f, sortClouds);
+
+    bot.setFrameUniforms(gGL);
+    gRenderQueue.sort();
+    size_t firstBlended = gRenderQueue.firstBlended();
+    gRenderQueue.submit(gGL, 0, firstBlended);
+    if (firstBlended == gRenderQueue.size()) return;
+
+    if (useWeightedOIT) beginWeightedOIT();
+    bool counting = beginCloudFragmentQuery();
+    gRenderQueue.submit(gGL, firstBlended, gRenderQueue.size());
+    if (counting) glEndQuery(GL_SAMPLES_PASSED);
+    if (useWeightedOIT) compositeWeightedOIT();
 }
 
-static void renderCloudFieldDepth(Cloud& cloud, MyBot& bot, float t) {
-    int baseX = (int)floorf(eye_center.x / CLOUD_SPACING);
-    int baseZ = (int)floorf(eye_center.z / CLOUD_SPACING);
+// Per-draw data of the depth passes' packets.
+struct DepthDraw {
+    glm::mat4 model;
+    int lod;
+};
+static std::vector<DepthDraw> gDepthDraws;
 
-    for (int dz = -CLOUD_RADIUS; dz <= CLOUD_RADIUS; ++dz) {
-        for (int dx = -CLOUD_RADIUS; dx <= CLOUD_RADIUS; ++dx) {
-            int cx = baseX + dx;
-            int cz = baseZ + dz;
+static void drawCloudDepthPacket(GLStateCache&, void* context, uint32_t item) {
+    const DepthDraw& draw = gDepthDraws[item];
+    glUniformMatrix4fv(gCloudDepth_uModel, 1, GL_FALSE, glm::value_ptr(draw.model));
+    static_cast<Cloud*>(context)->drawLod(draw.lod);
+}
 
-            uint32_t h = hash2i(cx, cz);
+static void drawCloudDepthInstancedPacket(GLStateCache&, void* context, uint32_t) {
+    static_cast<Cloud*>(context)->drawInstances();
+}
 
-            float jitterAmp = CLOUD_SPACING * 0.75f;
-            float jx = hashSigned01(h * 747796405u + 2891336453u) * jitterAmp;
-            float jz = hashSigned01(h * 277803737u + 15485863u) * jitterAmp;
+static void drawBotDepthPacket(GLStateCache&, void* context, uint32_t item) {
+    MyBot& bot = *static_cast<MyBot*>(context);
+    glUniformMatrix4fv(gBotDepth_uModel, 1, GL_FALSE, glm::value_ptr(gDepthDraws[item].model));
+    bot.drawModel();
+}
 
-            float worldX = cx * CLOUD_SPACING + jx;
-            float worldZ = cz * CLOUD_SPACING + jz;
+static void drawBotDepthInstancedPacket(GLStateCache&, void* context, uint32_t count) {
+    MyBot& bot = *static_cast<MyBot*>(context);
+    bot.drawModel((GLsizei)count);
+}
 
-            float layerPick = hash01(h * 9781u + 6271u);
-            float baseLayer = (layerPick < 0.55f) ? CLOUD_LAYER_LOW : CLOUD_LAYER_HIGH;
+// lightIndex selects the light matrix in the frame uniforms: -1 for the single shadow
+// map, otherwise the cascade.
+static void drawCloudCastersDepth(Cloud& cloud, int lightIndex, const Frustum& lightFrustum) {
+    gCullStats.cloudCasters = CullSpheres(lightFrustum, gField.cloudBounds, eye_center, -1.0f, gField.cloudVisible);
+
+    gRenderQueue.clear();
+    gDepthDraws.clear();
+    gCloudInstances.clear();
+    gCloudInstanceLods.clear();
+    for (size_t i = 0; i < gField.cloudM.size(); ++i) {
+        if (!gField.cloudVisible[i]) continue;
+        if (useCloudInstancing) {
+            gCloudInstances.push_back(gField.cloudM[i]);
+            gCloudInstanceLods.push_back(cloudShadowLod(gField.cloudLod[i]));
+            continue;
+        }
+        DepthDraw draw = { gField.cloudM[i] * cloud.dequantize, cloudShadowLod(gField.cloudLod[i]) };
+        gDepthDraws.push_back(draw);
+        DrawPacket packet = { MakeDrawKey(PASS_DEPTH, BLEND_NONE, gCloudDepthProg, cloud.vao, 0, 0.0f),
+            gCloudDepthProg, cloud.vao, 0, BLEND_NONE, true, true, drawCloudDepthPacket, &cloud, (uint32_t)(gDepthDraws.size() - 1) };
+        gRenderQueue.push(packet);
+    }
+    if (!gCloudInstances.empty()) {
+        cloud.uploadInstances(gCloudInstances, gCloudInstanceLods);
+        DrawPacket packet = { MakeDrawKey(PASS_DEPTH, BLEND_NONE, gCloudDepthInstProg, cloud.vao, 0, 0.0f),
+            gCloudDepthInstProg, cloud.vao, 0, BLEND_NONE, true, true, drawCloudDepthInstancedPacket, &cloud, 0 };
+        gRenderQueue.push(packet);
+    }
+    if (gRenderQueue.size() == 0) return;
+
+    gGL.useProgram(gCloudDepthProg);
+    glUniform1i(gCloudDepth_uLightIndex, lightIndex);
+    gGL.useProgram(gCloudDepthInstProg);
+    glUniform1i(gCloudDepthInst_uLightIndex, lightIndex);
+    gRenderQueue.sort();
+    gRenderQueue.submit(gGL);
+}
 
-            float yJitter = hashSigned01(h * 1597334677u + 3812015801u) * CLOUD_LAYER_BLEND;
-            float cloudY = baseLayer + yJitter;
+static void drawBotCastersDepth(MyBot& bot, int lightIndex, const Frustum& lightFrustum) {
+    gCullStats.botCasters = CullSpheres(lightFrustum, gField.botBounds, eye_center, -1.0f, gField.botVisible);
+
+    gRenderQueue.clear();
+    gDepthDraws.clear();
+    gGL.useProgram(gBotDepthProg);
+    glUniform1i(gBotDepth_uLightIndex, lightIndex);
+
+    if (useBotInstancing) {
+        if (!useBakedAnimation) bot.ensurePalettes(gField.botVisible, gField.botAnimTime, gField.botLod);
+        GLsizei count = bot.uploadInstances(gField.botM, gField.botVisible, gField.botAnimTime);
+        if (count == 0) return;
+
+        glUniform1i(gBotDepth_uInstanced, 1);
+        glUniform1i(gBotDepth_uPreSkinned, 0);
+        bot.bindPaletteTexture(gBotDepth_uPalettes, 13);
+        bot.bindBakedAnimation(gBotDepth_uBaked, gBotDepth_uBakedFrameCount, gBotDepth_uBakedFPS);
+        DrawPacket packet = { MakeDrawKey(PASS_DEPTH, BLEND_NONE, gBotDepthProg, 0, 0, 0.0f),
+            gBotDepthProg, 0, 0, BLEND_NONE, true, true, drawBotDepthInstancedPacket, &bot, (uint32_t)count };
+        gRenderQueue.push(packet);
+    }
+    else {
+        glUniform1i(gBotDepth_uInstanced, 0);
+        glUniform1i(gBotDepth_uBaked, 0);
+        glUniform1i(gBotDepth_uPreSkinned, usePreSkinning ? 1 : 0);
+        if (!usePreSkinning && !bot.skinObjects.empty() && gBotDepth_uJoints >= 0) {
+            const auto& skin = bot.skinObjects[0];
+            if (!skin.jointMatrices.empty()) {
+                glUniformMatrix4fv(gBotDepth_uJoints, (GLsizei)skin.jointMatrices.size(),
+                    GL_FALSE, glm::value_ptr(skin.jointMatrices[0]));
+            }
+        }
+        for (size_t i = 0; i < gField.botM.size(); ++i) {
+            if (!gField.botVisible[i]) continue;
+            DepthDraw draw = { gField.botM[i], 0 };
+            gDepthDraws.push_back(draw);
+            DrawPacket packet = { MakeDrawKey(PASS_DEPTH, BLEND_NONE, gBotDepthProg, 0, 0, 0.0f),
+                gBotDepthProg, 0, 0, BLEND_NONE, true, true, drawBotDepthPacket, &bot, (uint32_t)(gDepthDraws.size() - 1) };
+            gRenderQueue.push(packet);
+        }
+    }
 
-            float sJitter = hashSigned01(h * 2654435761u + 1013904223u) * CLOUD_SCALE_JITTER;
-            float cloudScale = CLOUD_SCALE * (1.0f + sJitter);
+    gRenderQueue.sort();
+    gRenderQueue.submit(gGL);
+}
 
-            float rotY = hash01(h * 2246822519u + 3266489917u) * 6.2831853f;
+static bool gStaticShadowValid = false;
+
+static FrameUniforms makeFrameUniforms(const glm::mat4& vp, const glm::mat4& skyVP) {
+    FrameUniforms frame;
+    frame.viewProj = vp;
+    frame.skyViewProj = skyVP;
+    frame.lightVP = gLightVP;
+    for (int i = 0; i < MAX_CASCADES; ++i) {
+        frame.cascadeVP[i] = gCascades[i].lightVP;
+        frame.cascadeSplits[i] = gCascades[i].splitFar;
+        frame.cascadeBias[i] = gCascades[i].depthBias;
+    }
+    frame.cameraPosition = eye_center;
+    frame.fogStart = FOG_START;
+    frame.fogColor = FOG_COLOR;
+    frame.fogEnd = FOG_END;
+    frame.lightPosition = lightPosition;
+    frame.shadowMode = useCascadedShadows ? 1 : 0;
+    frame.lightIntensity = lightIntensity;
+    frame.cascadeCount = gCascadeCount;
+    frame.viewForward = glm::normalize(lookat - eye_center);
+    frame.weightedOIT = useWeightedOIT ? 1 : 0;
+    return frame;
+}
 
-            glm::mat4 cloudM =
-                glm::translate(glm::mat4(1.0f), glm::vec3(worldX, cloudY, worldZ)) *
-                glm::rotate(glm::mat4(1.0f), rotY, glm::vec3(0, 1, 0)) *
-                glm::scale(glm::mat4(1.0f), glm::vec3(cloudScale));
+// Each cascade is refit and redrawn on its own schedule; skipped cascades keep their
+// previous matrix so the depth they hold stays consistent with what bot.frag samples.
+// Fitting runs before the frame uniforms are uploaded, drawing after.
+static void fitCascades(const glm::mat4& view, const glm::vec3& lightDir) {
+    float aspect = (float)windowWidth / (float)windowHeight;
+    glm::mat4 invView = glm::inverse(view);
+
+    float sliceNear = zNear;
+    for (int i = 0; i < gCascadeCount; ++i) {
+        ShadowCascade& cascade = gCascades[i];
+        float sliceFar = cascadeSplitDistance(i + 1, gCascadeCount, zNear, FOG_END);
+
+        int interval = CASCADE_UPDATE_INTERVAL[i];
+        bool due = ((gFrameIndex + (unsigned long)i) % (unsigned long)interval) == 0;
+        cascade.refresh = due || !cascade.valid;
+        if (cascade.refresh) {
+            cascade.splitFar = sliceFar;
+            cascade.lightVP = computeCascadeLightVP(invView, aspect, sliceNear, sliceFar, lightDir, cascade.res,
+                cascade.depthBias);
+        }
+        sliceNear = sliceFar;
+    }
+}
 
-            glUseProgram(gCloudDepthProg);
-            glUniformMatrix4fv(gCloudDepth_uLightVP, 1, GL_FALSE, glm::value_ptr(gLightVP));
-            glUniformMatrix4fv(gCloudDepth_uModel, 1, GL_FALSE, glm::value_ptr(cloudM));
-            glBindVertexArray(cloud.vao);
-            glDrawElements(GL_TRIANGLES, (GLsizei)cloud.indices.size(), GL_UNSIGNED_INT, (void*)0);
-            glBindVertexArray(0);
+static void renderCascadesDepth(Cloud& cloud, MyBot& bot, float t) {
+    // the cascades end at the fog; a caster further out than a tile past it cannot reach them
+    gatherCloudField(cloud, bot, t, gField, nullptr, FOG_END + CLOUD_SPACING);
 
-            float r = hash01(h);
-            if (r > BOT_SPAWN_CHANCE) continue;
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
 
-            float phase = (h & 0xFFFFu) * (1.0f / 65535.0f) * 6.2831853f;
-            float speed = 0.7f + 0.6f * hash01(h >> 8);
+    size_t cloudCasters = 0, botCasters = 0;
+    for (int i = 0; i < gCascadeCount; ++i) {
+        ShadowCascade& cascade = gCascades[i];
+        if (!cascade.refresh) continue;
+        Frustum lightFrustum = ExtractFrustumPlanes(cascade.lightVP);
 
-            glm::vec3 centerLocal = cloud.localCenter;
-            glm::vec3 centerOffset = glm::vec3(centerLocal.x * cloudScale,
-                centerLocal.y * cloudScale,
-                centerLocal.z * cloudScale);
+        glViewport(0, 0, cascade.res, cascade.res);
+        glBindFramebuffer(GL_FRAMEBUFFER, cascade.fbo);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        drawCloudCastersDepth(cloud, i, lightFrustum);
+        cloudCasters += gCullStats.cloudCasters;
+        drawBotCastersDepth(bot, i, lightFrustum);
+        botCasters += gCullStats.botCasters;
 
-            glm::vec3 centerOffsetRot = glm::vec3(
-                cosf(rotY) * centerOffset.x + sinf(rotY) * centerOffset.z,
-                centerOffset.y,
-                -sinf(rotY) * centerOffset.x + cosf(rotY) * centerOffset.z
-            );
+        cascade.valid = true;
+        ++gCullStats.cascadeRefreshes;
+    }
+    gCullStats.cloudCasters = cloudCasters;
+    gCullStats.botCasters = botCasters;
 
-            glm::vec3 cloudCenterWorld = glm::vec3(worldX, cloudY, worldZ) + centerOffsetRot;
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-            float runRadius = 2.0f;
-            float ang = t * speed + phase;
+// Clouds go to the static layer, which is only redrawn when the light matrix changed
+// (every frame without the cache, on tile-window moves with it); bots go to the
+// dynamic layer every frame.
+static void renderCloudFieldDepth(Cloud& cloud, MyBot& bot, float t, bool lightMoved) {
+    Frustum lightFrustum = ExtractFrustumPlanes(gLightVP);
+    gatherCloudField(cloud, bot, t, gField, &lightFrustum, -1.0f);
 
-            float bx = cloudCenterWorld.x + cosf(ang) * runRadius;
-            float bz = cloudCenterWorld.z + sinf(ang) * runRadius;
-            float by = cloudCenterWorld.y * 0.75f;
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
 
-            float heading = ang + 1.5707963f;
+    if (!useShadowCache || lightMoved || !gStaticShadowValid) {
+        glViewport(0, 0, SHADOW_RES, SHADOW_RES);
+        glBindFramebuffer(GL_FRAMEBUFFER, gShadowFBO);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        drawCloudCastersDepth(cloud, -1, lightFrustum);
+        gStaticShadowValid = true;
+        ++gCullStats.staticShadowRefreshes;
+    }
 
-            glm::mat4 botM =
-                glm::translate(glm::mat4(1.0f), glm::vec3(bx, by, bz)) *
-                glm::rotate(glm::mat4(1.0f), heading, glm::vec3(0, 1, 0)) *
-                glm::scale(glm::mat4(1.0f), glm::vec3(BOT_SCALE));
+    glViewport(0, 0, SHADOW_DYN_RES, SHADOW_DYN_RES);
+    glBindFramebuffer(GL_FRAMEBUFFER, gShadowDynFBO);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    drawBotCastersDepth(bot, -1, lightFrustum);
 
-            glUseProgram(gBotDepthProg);
-            glUniformMatrix4fv(gBotDepth_uLightVP, 1, GL_FALSE, glm::value_ptr(gLightVP));
-            glUniformMatrix4fv(gBotDepth_uModel, 1, GL_FALSE, glm::value_ptr(botM));
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-            if (!bot.skinObjects.empty() && gBotDepth_uJoints >= 0) {
-                const auto& skin = bot.skinObjects[0];
-                if (!skin.jointMatrices.empty()) {
-                    glUniformMatrix4fv(gBotDepth_uJoints, (GLsizei)skin.jointMatrices.size(),
-                        GL_FALSE, glm::value_ptr(skin.jointMatrices[0]));
+// --bench-keyframes: a field's worth of bots plays clip 0 at staggered times; every
+// sampler's key interval is looked up with the binary search and with the per-bot
+// cursors, timed separately, then both are compared on random (scrubbed) times too.
+static int runKeyframeBenchmark() {
+    MyBot bot;
+    if (!bot.loadAnimation() || bot.animationObjects.empty()) return -1;
+    const std::vector<MyBot::SamplerObject>& samplers = bot.animationObjects[0].samplers;
+
+    const int botCount = (2 * CLOUD_RADIUS + 1) * (2 * CLOUD_RADIUS + 1);
+    const int frameCount = 3600;
+    const float dt = 1.0f / 60.0f;
+    std::vector<int> cursors(botCount * samplers.size(), 0);
+
+    auto run = [&](bool useCursors, long long& checksum) {
+        checksum = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int f = 0; f < frameCount; ++f) {
+            for (int b = 0; b < botCount; ++b) {
+                float time = b * 0.37f + f * dt;
+                int* botCursors = &cursors[b * samplers.size()];
+                for (size_t s = 0; s < samplers.size(); ++s) {
+                    const std::vector<float>& times = samplers[s].input;
+                    if (times.size() < 2) continue;
+                    float animationTime = fmod(time, times.back());
+                    checksum += useCursors ? MyBot::advanceKeyframeCursor(times, animationTime, botCursors[s])
+                        : MyBot::findKeyframeIndex(times, animationTime);
                 }
             }
+        }
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+
+    long long searchSum = 0, cursorSum = 0;
+    double searchMs = run(false, searchSum);
+    double cursorMs = run(true, cursorSum);
+
+    std::mt19937 rng(1234);
+    size_t mismatches = 0;
+    for (int i = 0; i < 100000; ++i) {
+        size_t s = rng() % samplers.size();
+        const std::vector<float>& times = samplers[s].input;
+        if (times.size() < 2) continue;
+        float animationTime = std::uniform_real_distribution<float>(-0.5f, times.back())(rng);
+        if (MyBot::advanceKeyframeCursor(times, animationTime, cursors[s]) != MyBot::findKeyframeIndex(times, animationTime))
+            ++mismatches;
+    }
+
+    double lookups = (double)frameCount * botCount * samplers.size();
+    std::cout << std::fixed << std::setprecision(2)
+        << "Keyframe lookups: " << botCount << " bots x " << samplers.size() << " samplers x " << frameCount << " frames\n"
+        << "  binary search: " << searchMs << " ms (" << searchMs * 1e6 / lookups << " ns/lookup)\n"
+        << "  cursors:       " << cursorMs << " ms (" << cursorMs * 1e6 / lookups << " ns/lookup)\n"
+        << "  playback results " << (searchSum == cursorSum ? "match" : "DIFFER")
+        << ", scrubbing mismatches: " << mismatches << "\n";
+    return (searchSum == cursorSum && mismatches == 0) ? 0 : 1;
+}
+
+// --bench-sort: the view depths of the cloud tiles of windows of growing radius, seen
+// from the center looking down -z, sorted back to front with the radix sort and with
+// std::stable_sort, which must agree. This measures the sort cost only: the blended
+// cloud sample counts come from a GL query and are shown in the window title.
+static int runSortBenchmark() {
+    Cloud cloud;    // unloaded: bounds around the tile origins, which is all the depths need
+    const int radii[] = { 5, 20, 50, 100, CLOUD_RADIUS_MAX };
+    const glm::vec3 eye(0.0f, 150.0f, 0.0f), forward(0.0f, 0.0f, -1.0f);
+    bool allMatch = true;
+
+    std::cout << std::fixed << std::setprecision(2) << "Back-to-front sort of cloud tiles\n";
+    for (int radius : radii) {
+        std::vector<uint32_t> keys;
+        std::vector<float> depths;
+        for (int cz = -radius; cz <= radius; ++cz) {
+            for (int cx = -radius; cx <= radius; ++cx) {
+                float depth = glm::dot(buildCloudTile(cx, cz, cloud).cloudCenterWorld - eye, forward);
+                depths.push_back(depth);
+                keys.push_back(~FloatSortKey(depth));
+            }
+        }
+
+        int repeats = glm::max(1, 2000000 / (int)keys.size());
+        std::vector<uint32_t> order, reference(keys.size());
+        std::vector<uint64_t> scratch;
 
-            bot.drawModel(bot.primitiveObjects, bot.model);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repeats; ++r) RadixSortIndices(keys.data(), keys.size(), order, scratch);
+        double radixMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repeats;
+
+        start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repeats; ++r) {
+            for (size_t i = 0; i < reference.size(); ++i) reference[i] = (uint32_t)i;
+            std::stable_sort(reference.begin(), reference.end(),
+                [&](uint32_t a, uint32_t b) { return depths[a] > depths[b]; });
         }
+        double stdMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repeats;
+
+        bool match = order == reference;
+        allMatch = allMatch && match;
+        std::cout << "  " << std::setw(6) << keys.size() << " tiles: radix " << radixMs * 1000.0 << " us ("
+            << radixMs * 1e6 / keys.size() << " ns/tile), std::stable_sort " << stdMs * 1000.0 << " us ("
+            << stdMs * 1e6 / keys.size() << " ns/tile), orders " << (match ? "match" : "DIFFER") << "\n";
     }
+    return allMatch ? 0 : 1;
 }
 
-int main(void) {
+// --bench-batch-math: the batch kernels against the glm expressions they replace, on
+// random transforms. Reports the time per transform of both and the largest relative
+// difference of any matrix element, which must stay at rounding level.
+static int runBatchMathBenchmark() {
+    const size_t count = 1000;
+    const int repeats = 2000;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f), scale(0.5f, 1.5f);
+
+    std::vector<glm::vec3> t(count), s(count);
+    std::vector<glm::quat> q(count);
+    TRSBatch trs;
+    trs.resize(count);
+    std::vector<glm::mat4> a(count), b(count), ref(count), out(count);
+    std::vector<int> parents(count);
+    auto randomTransform = [&]() {
+        glm::quat r = glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+        return glm::translate(glm::mat4(1.0f), glm::vec3(unit(rng), unit(rng), unit(rng))) * glm::mat4_cast(r) *
+            glm::scale(glm::mat4(1.0f), glm::vec3(scale(rng), scale(rng), scale(rng)));
+    };
+    for (size_t i = 0; i < count; ++i) {
+        t[i] = 10.0f * glm::vec3(unit(rng), unit(rng), unit(rng));
+        q[i] = glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+        s[i] = glm::vec3(scale(rng), scale(rng), scale(rng));
+        trs.set(i, t[i], q[i], s[i]);
+        a[i] = randomTransform();
+        b[i] = randomTransform();
+        parents[i] = i == 0 ? -1 : (int)(rng() % i);
+    }
+
+    auto nsPerTransform = [&](const std::function<void()>& f) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repeats; ++r) f();
+        return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() /
+            ((double)repeats * count);
+    };
+    auto maxDifference = [&]() {
+        float worst = 0.0f;
+        for (size_t i = 0; i < count; ++i)
+            for (int c = 0; c < 4; ++c)
+                for (int r = 0; r < 4; ++r)
+                    worst = glm::max(worst, fabsf(out[i][c][r] - ref[i][c][r]) / glm::max(1.0f, fabsf(ref[i][c][r])));
+        return worst;
+    };
+
+    const float tolerance = 1e-5f;
+    bool allMatch = true;
+    auto report = [&](const char* name, double glmNs, double batchNs) {
+        float diff = maxDifference();
+        allMatch = allMatch && diff <= tolerance;
+        std::cout << "  " << name << "glm " << std::fixed << std::setprecision(1) << glmNs << " ns, batch " << batchNs
+            << " ns, max difference " << std::scientific << std::setprecision(1) << diff
+            << (diff <= tolerance ? "" : " (DIFFER)") << "\n";
+    };
+
+    std::cout << "Batch math (" << BatchMathBackend() << "), " << count << " transforms\n";
+
+    double glmNs = nsPerTransform([&]() {
+        for (size_t i = 0; i < count; ++i)
+            ref[i] = glm::translate(glm::mat4(1.0f), t[i]) * glm::mat4_cast(q[i]) * glm::scale(glm::mat4(1.0f), s[i]);
+    });
+    double batchNs = nsPerTransform([&]() { ComposeTRSBatch(trs, out.data()); });
+    report("compose TRS: ", glmNs, batchNs);
+
+    glmNs = nsPerTransform([&]() {
+        for (size_t i = 0; i < count; ++i) ref[i] = a[i] * b[i];
+    });
+    batchNs = nsPerTransform([&]() { MultiplyMat4Batch(a.data(), nullptr, b.data(), out.data(), count); });
+    report("multiply:    ", glmNs, batchNs);
+
+    glmNs = nsPerTransform([&]() {
+        for (size_t k = 0; k < count; ++k) ref[k] = parents[k] < 0 ? a[k] : ref[parents[k]] * a[k];
+    });
+    batchNs = nsPerTransform([&]() { ConcatenateHierarchy(parents.data(), a.data(), out.data(), count); });
+    report("hierarchy:   ", glmNs, batchNs);
+
+    return allMatch ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench-keyframes") == 0) return runKeyframeBenchmark();
+        if (strcmp(argv[i], "--bench-sort") == 0) return runSortBenchmark();
+        if (strcmp(argv[i], "--bench-batch-math") == 0) return runBatchMathBenchmark();
+        if (strcmp(argv[i], "--cloud-radius") == 0 && i + 1 < argc)
+            gCloudRadius = glm::clamp(atoi(argv[++i]), 1, CLOUD_RADIUS_MAX);
+        if (strcmp(argv[i], "--cascades") == 0 && i + 1 < argc)
+            gCascadeCount = glm::clamp(atoi(argv[++i]), 1, MAX_CASCADES);
+    }
+
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW.\n";
         return -1;
@@ -1270,6 +3953,9 @@ int main(void) {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    // the OIT pass blits this depth buffer into a DEPTH24_STENCIL8 target
+    glfwWindowHint(GLFW_DEPTH_BITS, 24);
+    glfwWindowHint(GLFW_STENCIL_BITS, 8);
 
     window = glfwCreateWindow(windowWidth, windowHeight, "Final Project > FPS: ", NULL, NULL);
     if (window == NULL) {
@@ -1292,6 +3978,10 @@ int main(void) {
     glEnable(GL_CULL_FACE);
     glCullFace(GL_BACK);
 
+    // before any program is loaded: the impostor bake already draws with it
+    initFrameUniforms();
+    initGeometry();
+
     Skybox sky;
     sky.initialize();
 
@@ -1301,14 +3991,22 @@ int main(void) {
     MyBot bot;
     bot.initialize();
 
+    std::cout << "Geometry arena: " << gGeometry.bufferCount() << " buffers, "
+        << gGeometry.vertexBytesUsed() / 1024 << " KiB vertices, " << gGeometry.indexBytesUsed() / 1024 << " KiB indices\n";
+    // the pool started with the bake above; palette evaluation shares it every frame
+    std::cout << "Animation threads: " << ParallelWorkerCount() << "\n";
+
     initShadowMap();
     initDepthPrograms();
+    initOcclusionCulling();
+    initWeightedOIT();
+    // loading set GL state behind the tracker's back
+    gGL.invalidate();
 
     glm::mat4 projectionMatrix =
         glm::perspective(glm::radians(FoV), (float)windowWidth / (float)windowHeight, zNear, zFar);
 
     double lastTime = glfwGetTime();
-    float time = 0.0f;
     float fTime = 0.0f;
     unsigned long frames = 0;
 
@@ -1320,36 +4018,51 @@ int main(void) {
         updateCamera(deltaTime);
 
         if (playAnimation) {
-            time += deltaTime * playbackSpeed;
-            bot.update(time);
+            gAnimTime += deltaTime * playbackSpeed;
+            if (!useBotInstancing) bot.update(gAnimTime);
+        }
+        if (useBotInstancing) {
+            bot.beginInstanceFrame();
+        }
+        else if (usePreSkinning) {
+            // re-run even when paused: the buffer must hold the current pose after toggling P
+            bot.preSkin();
         }
 
         glm::mat4 viewMatrix = glm::lookAt(eye_center, lookat, up);
         glm::mat4 vp = projectionMatrix * viewMatrix;
+        glm::mat4 skyVP = projectionMatrix * glm::mat4(glm::mat3(viewMatrix));
 
-        gLightVP = computeLightVP();
-        glViewport(0, 0, SHADOW_RES, SHADOW_RES);
-        glBindFramebuffer(GL_FRAMEBUFFER, gShadowFBO);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        glEnable(GL_POLYGON_OFFSET_FILL);
-        glPolygonOffset(2.0f, 4.0f);
-        renderCloudFieldDepth(cloud, bot, (float)glfwGetTime());
-        glDisable(GL_POLYGON_OFFSET_FILL);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        bool tilesMoved = gCloudTiles.update(eye_center, cloud);
+        glm::vec3 tileCenter((gCloudTiles.baseX + 0.5f) * CLOUD_SPACING, CLOUD_Y,
+            (gCloudTiles.baseZ + 0.5f) * CLOUD_SPACING);
+
+        // every light matrix of the frame is settled before the frame uniforms go up
+        if (useCascadedShadows) {
+            fitCascades(viewMatrix, glm::normalize(tileCenter - lightPosition));
+        }
+        else if (useShadowCache) gLightVP = computeLightVP(tileCenter, true);
+        else gLightVP = computeLightVP(eye_center, false);
+        uploadFrameUniforms(makeFrameUniforms(vp, skyVP));
+
+        if (useCascadedShadows) renderCascadesDepth(cloud, bot, (float)glfwGetTime());
+        else renderCloudFieldDepth(cloud, bot, (float)glfwGetTime(), tilesMoved);
         glViewport(0, 0, windowWidth, windowHeight);
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        glDepthMask(GL_FALSE);
+        gGL.setDepthMask(false);
         glCullFace(GL_FRONT);
-        glm::mat4 viewNoTrans = glm::mat4(glm::mat3(viewMatrix));
-        sky.render(projectionMatrix, viewNoTrans);
+        sky.render();
         glCullFace(GL_BACK);
-        glDepthMask(GL_TRUE);
+        gGL.setDepthMask(true);
 
         renderCloudField(vp, cloud, bot, (float)glfwGetTime());
+        gCullStats.gl = gGL.stats();
+        gGL.resetStats();
 
         frames++;
+        gFrameIndex++;
         fTime += deltaTime;
         if (fTime > 2.0f) {
             float fps = frames / fTime;
@@ -1357,7 +4070,24 @@ int main(void) {
             fTime = 0;
             std::stringstream stream;
             stream << std::fixed << std::setprecision(2)
-                << "Final Project > FPS: " << fps;
+                << "Final Project > FPS: " << fps
+                << " | clouds " << gCullStats.cloudsVisible << "/" << gCullStats.cloudsTotal
+                << " (blocks " << gCullStats.blocksVisible << "/" << gCullStats.blocksTotal << ")"
+                << " | bots " << gCullStats.botsVisible << "/" << gCullStats.botsTotal
+                << " (occluded " << gCullStats.botsOccluded << ", queries " << gCullStats.occlusionQueries << ")"
+                << " | casters " << gCullStats.cloudCasters << "+" << gCullStats.botCasters
+                << " | cloud tris " << gCullStats.cloudTriangles / 1000 << "k, impostors " << gCullStats.cloudImpostors
+                << ", fragments " << gCullStats.cloudFragments / 1000 << "k"
+                << (useWeightedOIT ? " (OIT)" : "") << ", sort " << gCullStats.sortMicroseconds << " us"
+                << " | static shadow redraws " << gCullStats.staticShadowRefreshes
+                << " | GL programs " << gCullStats.gl.programBinds << ", vaos " << gCullStats.gl.vertexArrayBinds
+                << ", textures " << gCullStats.gl.textureBinds << ", states " << gCullStats.gl.stateChanges
+                << " (" << gCullStats.gl.skipped << " skipped)";
+            if (useBotInstancing && !useBakedAnimation) {
+                stream << " | poses";
+                for (int lod = 0; lod < BOT_ANIM_LODS; ++lod)
+                    stream << " L" << lod << " " << bot.lodStats.evaluated[lod] << "/" << bot.lodStats.bots[lod];
+            }
             glfwSetWindowTitle(window, stream.str().c_str());
         }
 
@@ -1368,6 +4098,7 @@ int main(void) {
     bot.cleanup();
     cloud.cleanup();
     sky.cleanup();
+    gGeometry.cleanup();
     glfwTerminate();
     return 0;
 }
@@ -1384,6 +4115,72 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
         playAnimation = !playAnimation;
     }
+    if (key == GLFW_KEY_I && action == GLFW_PRESS) {
+        useCloudInstancing = !useCloudInstancing;
+        std::cout << "Cloud instancing: " << (useCloudInstancing ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        useFrustumCulling = !useFrustumCulling;
+        std::cout << "Frustum culling: " << (useFrustumCulling ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+        useShadowCache = !useShadowCache;
+        gStaticShadowValid = false;
+        std::cout << "Shadow cache: " << (useShadowCache ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        usePreSkinning = !usePreSkinning;
+        std::cout << "Bot pre-skinning: " << (usePreSkinning ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        useBotInstancing = !useBotInstancing;
+        std::cout << "Bot instancing: " << (useBotInstancing ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+        useBakedAnimation = !useBakedAnimation;
+        std::cout << "Baked bot animation: " << (useBakedAnimation ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        useAnimationLod = !useAnimationLod;
+        std::cout << "Animation LOD: " << (useAnimationLod ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+        useCloudLod = !useCloudLod;
+        gStaticShadowValid = false;
+        std::cout << "Cloud LOD: " << (useCloudLod ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+        useCloudImpostors = !useCloudImpostors;
+        std::cout << "Cloud impostors: " << (useCloudImpostors ? "on" : "off") << "\n";
+    }
+    if ((key == GLFW_KEY_MINUS || key == GLFW_KEY_EQUAL) && action == GLFW_PRESS) {
+        int step = glm::max(1, gCloudRadius / 5);
+        gCloudRadius = glm::clamp(gCloudRadius + (key == GLFW_KEY_EQUAL ? step : -step), 1, CLOUD_RADIUS_MAX);
+        std::cout << "Cloud radius: " << gCloudRadius << " (" << (2 * gCloudRadius + 1) * (2 * gCloudRadius + 1) << " tiles)\n";
+    }
+    if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+        useOcclusionCulling = !useOcclusionCulling;
+        std::cout << "Occlusion culling: " << (useOcclusionCulling ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        useDepthSorting = !useDepthSorting;
+        std::cout << "Depth sorting: " << (useDepthSorting ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_U && action == GLFW_PRESS) {
+        useWeightedOIT = !useWeightedOIT;
+        std::cout << "Weighted blended OIT: " << (useWeightedOIT ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+        useCascadedShadows = !useCascadedShadows;
+        for (int i = 0; i < MAX_CASCADES; ++i) gCascades[i].valid = false;
+        gStaticShadowValid = false;
+        std::cout << "Cascaded shadows: " << (useCascadedShadows ? "on" : "off") << "\n";
+    }
+    if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+        gCascadeCount = gCascadeCount % MAX_CASCADES + 1;
+        for (int i = 0; i < MAX_CASCADES; ++i) gCascades[i].valid = false;
+        std::cout << "Shadow cascades: " << gCascadeCount << "\n";
+    }
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, GL_TRUE);
     }
@@ -0,0 +1,195 @@
+#include "batch_math.h"
+
+#if defined(__AVX__)
+#define BATCH_MATH_AVX 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BATCH_MATH_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// mat4_cast(q) * scale(s) with the translation in the last column, for one transform.
+void composeOne(const TRSBatch& b, size_t i, glm::mat4& m) {
+    float x = b.rx[i], y = b.ry[i], z = b.rz[i], w = b.rw[i];
+    float xx = x * x, yy = y * y, zz = z * z;
+    float xy = x * y, xz = x * z, yz = y * z;
+    float wx = w * x, wy = w * y, wz = w * z;
+
+    m[0] = glm::vec4(1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz), 2.0f * (xz - wy), 0.0f) * b.sx[i];
+    m[1] = glm::vec4(2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + wx), 0.0f) * b.sy[i];
+    m[2] = glm::vec4(2.0f * (xz + wy), 2.0f * (yz - wx), 1.0f - 2.0f * (xx + yy), 0.0f) * b.sz[i];
+    m[3] = glm::vec4(b.tx[i], b.ty[i], b.tz[i], 1.0f);
+}
+
+#if defined(BATCH_MATH_AVX) || defined(BATCH_MATH_SSE)
+
+// out = a * b, one column of the result per 4-wide multiply-add chain.
+inline void multiplySSE(const float* a, const float* b, float* out) {
+    __m128 a0 = _mm_loadu_ps(a), a1 = _mm_loadu_ps(a + 4), a2 = _mm_loadu_ps(a + 8), a3 = _mm_loadu_ps(a + 12);
+    for (int c = 0; c < 4; ++c) {
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[c * 4 + 0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[c * 4 + 1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[c * 4 + 2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[c * 4 + 3])));
+        _mm_storeu_ps(out + c * 4, r);
+    }
+}
+
+// Writes column c of four matrices, given that column's rows across the four lanes.
+inline void storeColumn4(__m128 r0, __m128 r1, __m128 r2, __m128 r3, glm::mat4** dst, int c) {
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(&(*dst[0])[c][0], r0);
+    _mm_storeu_ps(&(*dst[1])[c][0], r1);
+    _mm_storeu_ps(&(*dst[2])[c][0], r2);
+    _mm_storeu_ps(&(*dst[3])[c][0], r3);
+}
+
+#endif
+
+#if defined(BATCH_MATH_AVX)
+
+// Two result columns per 8-wide chain: each 128-bit half broadcasts its own column of b.
+inline void multiplyAVX(const float* a, const float* b, float* out) {
+    __m256 a0 = _mm256_broadcast_ps((const __m128*)a);
+    __m256 a1 = _mm256_broadcast_ps((const __m128*)(a + 4));
+    __m256 a2 = _mm256_broadcast_ps((const __m128*)(a + 8));
+    __m256 a3 = _mm256_broadcast_ps((const __m128*)(a + 12));
+    for (int c = 0; c < 4; c += 2) {
+        __m256 bc = _mm256_loadu_ps(b + c * 4);
+        __m256 r = _mm256_mul_ps(a0, _mm256_permute_ps(bc, 0x00));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_permute_ps(bc, 0x55)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_permute_ps(bc, 0xAA)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_permute_ps(bc, 0xFF)));
+        _mm256_storeu_ps(out + c * 4, r);
+    }
+}
+
+inline void multiplyKernel(const float* a, const float* b, float* out) { multiplyAVX(a, b, out); }
+
+// Eight transforms per iteration; the halves of each register are written out as two
+// groups of four.
+size_t composeWide(const TRSBatch& b, glm::mat4* out, const int* outIndex) {
+    const size_t n = b.size();
+    const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(&b.rx[i]), y = _mm256_loadu_ps(&b.ry[i]);
+        __m256 z = _mm256_loadu_ps(&b.rz[i]), w = _mm256_loadu_ps(&b.rw[i]);
+        __m256 sx = _mm256_loadu_ps(&b.sx[i]), sy = _mm256_loadu_ps(&b.sy[i]), sz = _mm256_loadu_ps(&b.sz[i]);
+
+        __m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+        __m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+        __m256 wx = _mm256_mul_ps(w, x), wy = _mm256_mul_ps(w, y), wz = _mm256_mul_ps(w, z);
+
+        __m256 col[4][4];
+        col[0][0] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), sx);
+        col[0][1] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx);
+        col[0][2] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx);
+        col[1][0] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy);
+        col[1][1] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))), sy);
+        col[1][2] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy);
+        col[2][0] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz);
+        col[2][1] = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz);
+        col[2][2] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), sz);
+        col[0][3] = col[1][3] = col[2][3] = zero;
+        col[3][0] = _mm256_loadu_ps(&b.tx[i]);
+        col[3][1] = _mm256_loadu_ps(&b.ty[i]);
+        col[3][2] = _mm256_loadu_ps(&b.tz[i]);
+        col[3][3] = one;
+
+        glm::mat4* dst[8];
+        for (int k = 0; k < 8; ++k) dst[k] = &out[outIndex ? outIndex[i + k] : i + k];
+        for (int c = 0; c < 4; ++c) {
+            storeColumn4(_mm256_castps256_ps128(col[c][0]), _mm256_castps256_ps128(col[c][1]),
+                _mm256_castps256_ps128(col[c][2]), _mm256_castps256_ps128(col[c][3]), dst, c);
+            storeColumn4(_mm256_extractf128_ps(col[c][0], 1), _mm256_extractf128_ps(col[c][1], 1),
+                _mm256_extractf128_ps(col[c][2], 1), _mm256_extractf128_ps(col[c][3], 1), dst + 4, c);
+        }
+    }
+    return i;
+}
+
+#elif defined(BATCH_MATH_SSE)
+
+inline void multiplyKernel(const float* a, const float* b, float* out) { multiplySSE(a, b, out); }
+
+// Four transforms per iteration, one register per matrix element.
+size_t composeWide(const TRSBatch& b, glm::mat4* out, const int* outIndex) {
+    const size_t n = b.size();
+    const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(&b.rx[i]), y = _mm_loadu_ps(&b.ry[i]);
+        __m128 z = _mm_loadu_ps(&b.rz[i]), w = _mm_loadu_ps(&b.rw[i]);
+        __m128 sx = _mm_loadu_ps(&b.sx[i]), sy = _mm_loadu_ps(&b.sy[i]), sz = _mm_loadu_ps(&b.sz[i]);
+
+        __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+        __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+        __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+        glm::mat4* dst[4];
+        for (int k = 0; k < 4; ++k) dst[k] = &out[outIndex ? outIndex[i + k] : i + k];
+
+        storeColumn4(
+            _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx),
+            _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx),
+            _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx),
+            zero, dst, 0);
+        storeColumn4(
+            _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy),
+            _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy),
+            _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy),
+            zero, dst, 1);
+        storeColumn4(
+            _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz),
+            _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz),
+            _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz),
+            zero, dst, 2);
+        storeColumn4(_mm_loadu_ps(&b.tx[i]), _mm_loadu_ps(&b.ty[i]), _mm_loadu_ps(&b.tz[i]), one, dst, 3);
+    }
+    return i;
+}
+
+#else
+
+inline void multiplyKernel(const float* a, const float* b, float* out) {
+    for (int c = 0; c < 4; ++c)
+        for (int r = 0; r < 4; ++r)
+            out[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] + a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+}
+
+size_t composeWide(const TRSBatch&, glm::mat4*, const int*) { return 0; }
+
+#endif
+
+} // namespace
+
+void ComposeTRSBatch(const TRSBatch& trs, glm::mat4* out, const int* outIndex) {
+    size_t i = composeWide(trs, out, outIndex);
+    for (; i < trs.size(); ++i)
+        composeOne(trs, i, out[outIndex ? outIndex[i] : i]);
+}
+
+void MultiplyMat4Batch(const glm::mat4* a, const int* aIndex, const glm::mat4* b, glm::mat4* out, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        multiplyKernel(&a[aIndex ? aIndex[i] : i][0][0], &b[i][0][0], &out[i][0][0]);
+}
+
+void ConcatenateHierarchy(const int* parents, const glm::mat4* local, glm::mat4* global, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        if (parents[k] < 0) global[k] = local[k];
+        else multiplyKernel(&global[parents[k]][0][0], &local[k][0][0], &global[k][0][0]);
+    }
+}
+
+const char* BatchMathBackend() {
+#if defined(BATCH_MATH_AVX)
+    return "AVX";
+#elif defined(BATCH_MATH_SSE)
+    return "SSE";
+#else
+    return "scalar";
+#endif
+}
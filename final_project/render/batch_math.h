@@ -0,0 +1,51 @@
+#ifndef _BATCH_MATH_H_
+#define _BATCH_MATH_H_
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <vector>
+#include <cstddef>
+
+// Matrix kernels over arrays of transforms. They run with AVX when the file is compiled
+// with it (FINAL_PROJECT_AVX), with SSE on any other x86 build and as plain C++
+// elsewhere; all three give the same results as the glm expressions they replace.
+
+// Translation, rotation (unit quaternion) and scale kept as separate component arrays,
+// so that four or eight transforms fill one SIMD register per component.
+struct TRSBatch {
+    std::vector<float> tx, ty, tz;
+    std::vector<float> rx, ry, rz, rw;
+    std::vector<float> sx, sy, sz;
+
+    size_t size() const { return tx.size(); }
+    void clear() { resize(0); }
+    void resize(size_t n) {
+        tx.resize(n); ty.resize(n); tz.resize(n);
+        rx.resize(n); ry.resize(n); rz.resize(n); rw.resize(n);
+        sx.resize(n); sy.resize(n); sz.resize(n);
+    }
+    void set(size_t i, const glm::vec3& t, const glm::quat& r, const glm::vec3& s) {
+        tx[i] = t.x; ty[i] = t.y; tz[i] = t.z;
+        rx[i] = r.x; ry[i] = r.y; rz[i] = r.z; rw[i] = r.w;
+        sx[i] = s.x; sy[i] = s.y; sz[i] = s.z;
+    }
+    void push(const glm::vec3& t, const glm::quat& r, const glm::vec3& s) {
+        resize(size() + 1);
+        set(size() - 1, t, r, s);
+    }
+};
+
+// out[outIndex ? outIndex[i] : i] = translate(t) * mat4_cast(r) * scale(s) for every entry.
+void ComposeTRSBatch(const TRSBatch& trs, glm::mat4* out, const int* outIndex = nullptr);
+
+// out[i] = a[aIndex ? aIndex[i] : i] * b[i]; out must not alias a or b.
+void MultiplyMat4Batch(const glm::mat4* a, const int* aIndex, const glm::mat4* b, glm::mat4* out, size_t count);
+
+// global[k] = local[k] for parents[k] < 0, global[parents[k]] * local[k] otherwise.
+// Every parent must come before its children.
+void ConcatenateHierarchy(const int* parents, const glm::mat4* local, glm::mat4* global, size_t count);
+
+// "AVX", "SSE" or "scalar".
+const char* BatchMathBackend();
+
+#endif
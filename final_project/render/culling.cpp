@@ -0,0 +1,80 @@
+#include "culling.h"
+
+#include <cmath>
+
+Frustum ExtractFrustumPlanes(const glm::mat4& m) {
+    // Gribb/Hartmann: the planes are sums/differences of the rows of the matrix.
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    Frustum f;
+    f.planes[0] = row3 + row0;
+    f.planes[1] = row3 - row0;
+    f.planes[2] = row3 + row1;
+    f.planes[3] = row3 - row1;
+    f.planes[4] = row3 + row2;
+    f.planes[5] = row3 - row2;
+
+    for (int i = 0; i < 6; ++i) {
+        float len = glm::length(glm::vec3(f.planes[i]));
+        if (len > 0.0f) f.planes[i] /= len;
+    }
+    return f;
+}
+
+static void cullByDistance(const SphereBatch& spheres, const glm::vec3& eye, float maxDistance, uint8_t* vis) {
+    const float* xs = spheres.x.data();
+    const float* ys = spheres.y.data();
+    const float* zs = spheres.z.data();
+    const float* rs = spheres.r.data();
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        float dx = xs[i] - eye.x;
+        float dy = ys[i] - eye.y;
+        float dz = zs[i] - eye.z;
+        float reach = maxDistance + rs[i];
+        vis[i] &= (uint8_t)(dx * dx + dy * dy + dz * dz <= reach * reach);
+    }
+}
+
+size_t CullSpheres(const Frustum& frustum, const SphereBatch& spheres,
+    const glm::vec3& eye, float maxDistance, std::vector<uint8_t>& visible) {
+    const size_t n = spheres.size();
+    visible.assign(n, 1);
+    if (n == 0) return 0;
+
+    const float* xs = spheres.x.data();
+    const float* ys = spheres.y.data();
+    const float* zs = spheres.z.data();
+    const float* rs = spheres.r.data();
+    uint8_t* vis = visible.data();
+
+    // one branch-free pass over the batch per plane
+    for (int p = 0; p < 6; ++p) {
+        const float a = frustum.planes[p].x;
+        const float b = frustum.planes[p].y;
+        const float c = frustum.planes[p].z;
+        const float d = frustum.planes[p].w;
+        for (size_t i = 0; i < n; ++i) {
+            float dist = a * xs[i] + b * ys[i] + c * zs[i] + d;
+            vis[i] &= (uint8_t)(dist >= -rs[i]);
+        }
+    }
+
+    if (maxDistance >= 0.0f) cullByDistance(spheres, eye, maxDistance, vis);
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) count += vis[i];
+    return count;
+}
+
+size_t CullSpheresByDistance(const SphereBatch& spheres, const glm::vec3& eye, float maxDistance,
+    std::vector<uint8_t>& visible) {
+    visible.assign(spheres.size(), 1);
+    cullByDistance(spheres, eye, maxDistance, visible.data());
+
+    size_t count = 0;
+    for (uint8_t v : visible) count += v;
+    return count;
+}
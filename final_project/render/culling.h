@@ -0,0 +1,39 @@
+#ifndef _CULLING_H_
+#define _CULLING_H_
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Six planes (left, right, bottom, top, near, far) with normals pointing inward,
+// normalized so that dot(plane.xyz, p) + plane.w is a signed distance.
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+// Works for both perspective and orthographic view-projection matrices.
+Frustum ExtractFrustumPlanes(const glm::mat4& viewProj);
+
+// Bounding spheres kept as separate arrays so the per-plane test loops vectorize.
+struct SphereBatch {
+    std::vector<float> x, y, z, r;
+
+    void clear() { x.clear(); y.clear(); z.clear(); r.clear(); }
+    size_t size() const { return x.size(); }
+    void push(const glm::vec3& c, float radius) {
+        x.push_back(c.x); y.push_back(c.y); z.push_back(c.z); r.push_back(radius);
+    }
+};
+
+// Sets visible[i] to 1 for every sphere that touches the frustum and is closer than
+// maxDistance to eye (pass a negative maxDistance to skip the distance test).
+// Returns the number of visible spheres.
+size_t CullSpheres(const Frustum& frustum, const SphereBatch& spheres,
+    const glm::vec3& eye, float maxDistance, std::vector<uint8_t>& visible);
+
+// The distance test of CullSpheres on its own.
+size_t CullSpheresByDistance(const SphereBatch& spheres, const glm::vec3& eye, float maxDistance,
+    std::vector<uint8_t>& visible);
+
+#endif
@@ -0,0 +1,232 @@
+#include "geometry_arena.h"
+#include "render_queue.h"
+
+#include <algorithm>
+
+#define BUFFER_OFFSET(i) ((char*)NULL + (i))
+
+void RangeAllocator::reset(size_t capacity) {
+    freeRanges.clear();
+    if (capacity > 0) freeRanges[0] = capacity;
+    total = capacity;
+    allocated = 0;
+}
+
+void RangeAllocator::grow(size_t newCapacity) {
+    if (newCapacity <= total) return;
+    size_t oldCapacity = total;
+    total = newCapacity;
+    allocated += newCapacity - oldCapacity;     // given back by free(), merging with a free tail
+    free(oldCapacity, newCapacity - oldCapacity);
+}
+
+size_t RangeAllocator::allocate(size_t size, size_t alignment) {
+    if (size == 0) return INVALID;
+    for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+        size_t start = it->first, end = it->first + it->second;
+        size_t aligned = (start + alignment - 1) / alignment * alignment;
+        if (aligned + size > end) continue;
+
+        freeRanges.erase(it);
+        if (aligned > start) freeRanges[start] = aligned - start;
+        if (aligned + size < end) freeRanges[aligned + size] = end - aligned - size;
+        allocated += size;
+        return aligned;
+    }
+    return INVALID;
+}
+
+void RangeAllocator::free(size_t offset, size_t size) {
+    if (size == 0) return;
+    allocated -= size;
+    auto next = freeRanges.lower_bound(offset);
+    if (next != freeRanges.end() && offset + size == next->first) {
+        size += next->second;
+        next = freeRanges.erase(next);
+    }
+    if (next != freeRanges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+    freeRanges[offset] = size;
+}
+
+int GeometryArena::addFormat(const VertexLayout& layout, size_t initialVertices) {
+    Format format;
+    format.layout = layout;
+    format.vertices.reset(initialVertices);
+    glGenBuffers(1, &format.vbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, format.vbo);
+    glBufferData(GL_COPY_WRITE_BUFFER, initialVertices * layout.stride, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    formats.push_back(format);
+    return (int)formats.size() - 1;
+}
+
+void GeometryArena::initialize(size_t initialIndexBytes) {
+    indexSpace.reset(initialIndexBytes);
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+    glBufferData(GL_COPY_WRITE_BUFFER, initialIndexBytes, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void GeometryArena::bindVertexArray(GLuint vao) const {
+    if (stateCache) stateCache->bindVertexArray(vao);
+    else glBindVertexArray(vao);
+}
+
+void GeometryArena::bindFormat(const Format& format, GLuint vao) const {
+    bindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, format.vbo);
+    for (const VertexAttribute& a : format.layout.attributes) {
+        glEnableVertexAttribArray(a.location);
+        glVertexAttribPointer(a.location, a.size, a.type, a.normalized, format.layout.stride, BUFFER_OFFSET(a.offset));
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+GLuint GeometryArena::createVertexArray(int format) {
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    bindFormat(formats[format], vao);
+    formats[format].vertexArrays.push_back(vao);
+    return vao;
+}
+
+void GeometryArena::bindIndices(GLuint vao) const {
+    bindVertexArray(vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    bindVertexArray(0);
+}
+
+GLuint GeometryArena::createVertexArray() {
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    bindIndices(vao);
+    indexOnlyArrays.push_back(vao);
+    return vao;
+}
+
+void GeometryArena::destroyVertexArray(GLuint vao) {
+    for (Format& format : formats) {
+        auto it = std::find(format.vertexArrays.begin(), format.vertexArrays.end(), vao);
+        if (it != format.vertexArrays.end()) format.vertexArrays.erase(it);
+    }
+    auto it = std::find(indexOnlyArrays.begin(), indexOnlyArrays.end(), vao);
+    if (it != indexOnlyArrays.end()) indexOnlyArrays.erase(it);
+    glDeleteVertexArrays(1, &vao);
+}
+
+// Copies the old contents into a buffer at least twice as large and points every
+// vertex array of the format at it.
+void GeometryArena::growVertices(Format& format, size_t minCapacity) {
+    size_t oldCapacity = format.vertices.capacity();
+    size_t newCapacity = std::max(minCapacity, 2 * oldCapacity);
+    GLuint vbo = 0;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * format.layout.stride, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, format.vbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldCapacity * format.layout.stride);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &format.vbo);
+
+    format.vbo = vbo;
+    format.vertices.grow(newCapacity);
+    for (GLuint vao : format.vertexArrays) bindFormat(format, vao);
+}
+
+void GeometryArena::growIndices(size_t minBytes) {
+    size_t oldCapacity = indexSpace.capacity();
+    size_t newCapacity = std::max(minBytes, 2 * oldCapacity);
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, ebo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldCapacity);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &ebo);
+
+    ebo = buffer;
+    indexSpace.grow(newCapacity);
+    for (const Format& format : formats)
+        for (GLuint vao : format.vertexArrays) bindFormat(format, vao);
+    for (GLuint vao : indexOnlyArrays) bindIndices(vao);
+}
+
+MeshRange GeometryArena::upload(int formatId, const void* vertices, size_t vertexCount, const uint32_t* indices,
+    size_t indexCount) {
+    Format& format = formats[formatId];
+    MeshRange range;
+    range.format = formatId;
+    range.vertexCount = (GLsizei)vertexCount;
+    range.indexCount = (GLsizei)indexCount;
+    range.indexType = vertexCount <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+    if (vertexCount > 0) {
+        size_t first = format.vertices.allocate(vertexCount);
+        if (first == RangeAllocator::INVALID) {
+            growVertices(format, format.vertices.capacity() + vertexCount);
+            first = format.vertices.allocate(vertexCount);
+        }
+        range.baseVertex = (GLint)first;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, format.vbo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first * format.layout.stride, vertexCount * format.layout.stride, vertices);
+    }
+
+    if (indexCount > 0) {
+        size_t bytes = indexCount * range.indexSize();
+        // 4-byte alignment keeps either index type aligned
+        size_t offset = indexSpace.allocate(bytes, 4);
+        if (offset == RangeAllocator::INVALID) {
+            growIndices(indexSpace.capacity() + bytes + 4);
+            offset = indexSpace.allocate(bytes, 4);
+        }
+        range.indexOffset = offset;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+        if (range.indexType == GL_UNSIGNED_SHORT) {
+            std::vector<uint16_t> shortIndices(indices, indices + indexCount);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, shortIndices.data());
+        }
+        else {
+            glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, indices);
+        }
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return range;
+}
+
+void GeometryArena::release(MeshRange& range) {
+    if (range.format < 0) return;
+    formats[range.format].vertices.free((size_t)range.baseVertex, (size_t)range.vertexCount);
+    if (range.indexCount > 0) indexSpace.free(range.indexOffset, range.indexCount * range.indexSize());
+    range = MeshRange();
+}
+
+void GeometryArena::cleanup() {
+    for (Format& format : formats) {
+        for (GLuint vao : format.vertexArrays) glDeleteVertexArrays(1, &vao);
+        if (format.vbo) glDeleteBuffers(1, &format.vbo);
+    }
+    formats.clear();
+    for (GLuint vao : indexOnlyArrays) glDeleteVertexArrays(1, &vao);
+    indexOnlyArrays.clear();
+    if (ebo) glDeleteBuffers(1, &ebo);
+    ebo = 0;
+    indexSpace.reset(0);
+}
+
+size_t GeometryArena::vertexBytesUsed() const {
+    size_t bytes = 0;
+    for (const Format& format : formats) bytes += format.vertices.used() * format.layout.stride;
+    return bytes;
+}
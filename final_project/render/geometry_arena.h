@@ -0,0 +1,118 @@
+#ifndef _GEOMETRY_ARENA_H_
+#define _GEOMETRY_ARENA_H_
+
+#include <glad/gl.h>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cstddef>
+
+class GLStateCache;
+
+// First-fit allocator of ranges in [0, capacity), in whatever unit the caller counts.
+// Freed ranges merge with their free neighbours.
+class RangeAllocator {
+public:
+    static const size_t INVALID = ~(size_t)0;
+
+    void reset(size_t capacity);
+    // Extends the space to newCapacity; the new part is free.
+    void grow(size_t newCapacity);
+    // Offset of a free range of size units starting at a multiple of alignment, or INVALID.
+    size_t allocate(size_t size, size_t alignment = 1);
+    void free(size_t offset, size_t size);
+
+    size_t capacity() const { return total; }
+    size_t used() const { return allocated; }
+
+private:
+    std::map<size_t, size_t> freeRanges;    // offset -> size
+    size_t total = 0;
+    size_t allocated = 0;
+};
+
+struct VertexAttribute {
+    GLuint location;
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    size_t offset;
+};
+
+// Interleaved vertex layout shared by every mesh stored in one format.
+struct VertexLayout {
+    GLsizei stride;
+    std::vector<VertexAttribute> attributes;
+};
+
+// A mesh in the arena: its vertices start at baseVertex of its format's buffer, its
+// indices at indexOffset bytes into the index buffer and are relative to baseVertex.
+struct MeshRange {
+    int format = -1;
+    GLint baseVertex = 0;
+    GLsizei vertexCount = 0;
+    size_t indexOffset = 0;
+    GLsizei indexCount = 0;
+    GLenum indexType = GL_UNSIGNED_SHORT;
+
+    size_t indexSize() const { return indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t); }
+    // Byte offset of index i, for the draw call.
+    size_t indexByteOffset(size_t i) const { return indexOffset + i * indexSize(); }
+};
+
+// All static geometry in one vertex buffer per vertex format and one index buffer
+// shared by every format, suballocated per mesh. Meshes of a format are drawn through
+// vertex arrays that read its buffer from vertex 0 with *BaseVertex draws, so one
+// vertex array serves any number of meshes. Buffers grow by copying when full.
+// Uploads bind through GL_COPY_WRITE_BUFFER and leave vertex array 0 bound.
+class GeometryArena {
+public:
+    // Vertex array binds, including those of a grow after drawing has started, go
+    // through the cache when one is set so that it does not keep a stale binding.
+    void setStateCache(GLStateCache* cache) { stateCache = cache; }
+    // Returns the format's id; its vertex buffer starts with room for initialVertices.
+    int addFormat(const VertexLayout& layout, size_t initialVertices);
+    void initialize(size_t initialIndexBytes);
+
+    // A vertex array with the format's attributes and the index buffer bound. The
+    // caller may add attributes from buffers of its own (per-instance data) and must
+    // destroy it with destroyVertexArray; the arena re-points it when a buffer grows.
+    GLuint createVertexArray(int format);
+    // A vertex array with only the index buffer bound, for vertices kept elsewhere
+    // (the caller sets its attributes) drawn with the arena's indices.
+    GLuint createVertexArray();
+    void destroyVertexArray(GLuint vao);
+
+    // Copies vertexCount vertices of the format's stride and the indices in, as 16-bit
+    // indices when vertexCount allows and 32-bit otherwise.
+    MeshRange upload(int format, const void* vertices, size_t vertexCount, const uint32_t* indices, size_t indexCount);
+    void release(MeshRange& range);
+
+    void cleanup();
+
+    size_t bufferCount() const { return formats.size() + (ebo ? 1 : 0); }
+    size_t vertexBytesUsed() const;
+    size_t indexBytesUsed() const { return indexSpace.used(); }
+
+private:
+    struct Format {
+        VertexLayout layout;
+        GLuint vbo = 0;
+        RangeAllocator vertices;
+        std::vector<GLuint> vertexArrays;
+    };
+
+    void bindVertexArray(GLuint vao) const;
+    void bindFormat(const Format& format, GLuint vao) const;
+    void bindIndices(GLuint vao) const;
+    void growVertices(Format& format, size_t minCapacity);
+    void growIndices(size_t minBytes);
+
+    std::vector<Format> formats;
+    std::vector<GLuint> indexOnlyArrays;
+    GLuint ebo = 0;
+    RangeAllocator indexSpace;      // bytes
+    GLStateCache* stateCache = nullptr;
+};
+
+#endif
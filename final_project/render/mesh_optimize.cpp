@@ -0,0 +1,407 @@
+#include "mesh_optimize.h"
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize) {
+    VertexCacheStats stats = { 0.0f, 0.0f };
+    size_t triangles = indices.size() / 3;
+    if (triangles == 0) return stats;
+
+    // FIFO: a vertex is resident while fewer than cacheSize misses happened since its own
+    std::vector<size_t> insertedAt(vertexCount, 0);
+    std::vector<uint8_t> referenced(vertexCount, 0);
+    size_t misses = 0, unique = 0;
+    for (uint32_t v : indices) {
+        if (!referenced[v]) { referenced[v] = 1; ++unique; }
+        if (insertedAt[v] == 0 || misses + 1 - insertedAt[v] > cacheSize) {
+            ++misses;
+            insertedAt[v] = misses;
+        }
+    }
+    stats.acmr = (float)misses / triangles;
+    stats.atvr = unique ? (float)misses / unique : 0.0f;
+    return stats;
+}
+
+namespace {
+
+struct Adjacency {
+    std::vector<uint32_t> offsets;      // vertexCount + 1
+    std::vector<uint32_t> triangles;
+};
+
+Adjacency buildAdjacency(const std::vector<uint32_t>& indices, size_t vertexCount) {
+    Adjacency adj;
+    adj.offsets.assign(vertexCount + 1, 0);
+    for (uint32_t v : indices) ++adj.offsets[v + 1];
+    for (size_t v = 0; v < vertexCount; ++v) adj.offsets[v + 1] += adj.offsets[v];
+
+    adj.triangles.resize(indices.size());
+    std::vector<uint32_t> fill(adj.offsets.begin(), adj.offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); ++i)
+        adj.triangles[fill[indices[i]]++] = (uint32_t)(i / 3);
+    return adj;
+}
+
+// Tipsify. Returns the triangle order; hardBoundaries marks positions in it where the
+// fan had to restart from a vertex outside the cache.
+std::vector<uint32_t> tipsify(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize,
+    std::vector<uint8_t>& hardBoundaries) {
+    size_t triangleCount = indices.size() / 3;
+    Adjacency adj = buildAdjacency(indices, vertexCount);
+
+    std::vector<uint32_t> live(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) live[v] = adj.offsets[v + 1] - adj.offsets[v];
+
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<uint8_t> emitted(triangleCount, 0);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> order;
+    order.reserve(triangleCount);
+    hardBoundaries.assign(triangleCount, 0);
+
+    uint32_t time = cacheSize + 1;
+    size_t scan = 0;
+    long fan = -1;
+    for (size_t v = 0; v < vertexCount && fan < 0; ++v)
+        if (live[v] > 0) fan = (long)v;
+
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t a = adj.offsets[fan]; a < adj.offsets[fan + 1]; ++a) {
+            uint32_t t = adj.triangles[a];
+            if (emitted[t]) continue;
+            emitted[t] = 1;
+            order.push_back(t);
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = indices[t * 3 + k];
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - cacheTime[v] > cacheSize) cacheTime[v] = time++;
+            }
+        }
+
+        // prefer the candidate that stays in cache the longest without needing more
+        // vertices than the cache can hold for its remaining triangles
+        long best = -1;
+        long bestPriority = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0) continue;
+            long priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) priority = time - cacheTime[v];
+            if (priority > bestPriority) { bestPriority = priority; best = v; }
+        }
+
+        if (best < 0) {
+            while (!deadEnd.empty() && best < 0) {
+                uint32_t v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0) best = v;
+            }
+            while (best < 0 && scan < vertexCount) {
+                if (live[scan] > 0) best = (long)scan;
+                ++scan;
+            }
+            if (best >= 0 && order.size() < triangleCount) hardBoundaries[order.size()] = 1;
+        }
+        fan = best;
+    }
+    return order;
+}
+
+} // namespace
+
+void OptimizeTriangleOrder(std::vector<uint32_t>& indices, size_t vertexCount, const float* positions,
+    unsigned cacheSize, float overdrawThreshold) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+
+    std::vector<uint8_t> hardBoundaries;
+    std::vector<uint32_t> order = tipsify(indices, vertexCount, cacheSize, hardBoundaries);
+
+    std::vector<uint32_t> sorted(indices.size());
+    for (size_t i = 0; i < triangleCount; ++i)
+        for (int k = 0; k < 3; ++k) sorted[i * 3 + k] = indices[order[i] * 3 + k];
+
+    if (!positions) {
+        indices.swap(sorted);
+        return;
+    }
+
+    // Split where a cluster, started with a cold cache, has amortized its ACMR to within
+    // the threshold of the whole order; hard boundaries always split.
+    float targetAcmr = AnalyzeVertexCache(sorted, vertexCount, cacheSize).acmr * overdrawThreshold;
+    std::vector<size_t> clusterStart(1, 0);
+    std::vector<size_t> insertedAt(vertexCount, 0);
+    size_t misses = 0, clusterMisses = 0, clusterTriangles = 0, clusterFirstMiss = 0;
+    for (size_t i = 0; i < triangleCount; ++i) {
+        if (i > 0 && (hardBoundaries[i] || (clusterTriangles > 0 && (float)clusterMisses / clusterTriangles <= targetAcmr))) {
+            clusterStart.push_back(i);
+            clusterMisses = 0;
+            clusterTriangles = 0;
+            clusterFirstMiss = misses;  // everything older counts as evicted
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = sorted[i * 3 + k];
+            if (insertedAt[v] <= clusterFirstMiss || misses + 1 - insertedAt[v] > cacheSize) {
+                ++misses;
+                ++clusterMisses;
+                insertedAt[v] = misses;
+            }
+        }
+        ++clusterTriangles;
+    }
+    clusterStart.push_back(triangleCount);
+
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    size_t clusterCount = clusterStart.size() - 1;
+    std::vector<glm::vec3> centroids(clusterCount), normals(clusterCount);
+    for (size_t c = 0; c < clusterCount; ++c) {
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t i = clusterStart[c]; i < clusterStart[c + 1]; ++i) {
+            const float* p0 = positions + sorted[i * 3] * 3;
+            const float* p1 = positions + sorted[i * 3 + 1] * 3;
+            const float* p2 = positions + sorted[i * 3 + 2] * 3;
+            glm::vec3 a(p0[0], p0[1], p0[2]), b(p1[0], p1[1], p1[2]), d(p2[0], p2[1], p2[2]);
+            glm::vec3 n = glm::cross(b - a, d - a);     // length is twice the area
+            float w = glm::length(n);
+            centroid += (a + b + d) * (w / 3.0f);
+            normal += n;
+            area += w;
+        }
+        meshCentroid += centroid;
+        meshArea += area;
+        centroids[c] = area > 0.0f ? centroid / area : glm::vec3(0.0f);
+        normals[c] = normal;
+    }
+    if (meshArea > 0.0f) meshCentroid /= meshArea;
+
+    // clusters far out along their own facing direction occlude the rest; draw them first
+    std::vector<float> sortKey(clusterCount);
+    std::vector<size_t> clusterOrder(clusterCount);
+    for (size_t c = 0; c < clusterCount; ++c) {
+        float len = glm::length(normals[c]);
+        sortKey[c] = len > 0.0f ? glm::dot(centroids[c] - meshCentroid, normals[c] / len) : 0.0f;
+        clusterOrder[c] = c;
+    }
+    std::stable_sort(clusterOrder.begin(), clusterOrder.end(),
+        [&](size_t a, size_t b) { return sortKey[a] > sortKey[b]; });
+
+    size_t out = 0;
+    for (size_t c : clusterOrder)
+        for (size_t i = clusterStart[c] * 3; i < clusterStart[c + 1] * 3; ++i) indices[out++] = sorted[i];
+}
+
+namespace {
+
+// Area-weighted sum of squared distances to a set of planes, as the symmetric 4x4
+// matrix of the plane equations; w is the total weight.
+struct Quadric {
+    double xx, xy, xz, yy, yz, zz, dx, dy, dz, dd;
+    double w;
+};
+
+void addPlane(Quadric& q, const glm::dvec3& n, double d, double w) {
+    q.xx += w * n.x * n.x; q.xy += w * n.x * n.y; q.xz += w * n.x * n.z;
+    q.yy += w * n.y * n.y; q.yz += w * n.y * n.z; q.zz += w * n.z * n.z;
+    q.dx += w * n.x * d; q.dy += w * n.y * d; q.dz += w * n.z * d;
+    q.dd += w * d * d;
+    q.w += w;
+}
+
+void addQuadric(Quadric& q, const Quadric& r) {
+    q.xx += r.xx; q.xy += r.xy; q.xz += r.xz;
+    q.yy += r.yy; q.yz += r.yz; q.zz += r.zz;
+    q.dx += r.dx; q.dy += r.dy; q.dz += r.dz;
+    q.dd += r.dd;
+    q.w += r.w;
+}
+
+double quadricError(const Quadric& q, const Quadric& r, const float* p) {
+    double x = p[0], y = p[1], z = p[2];
+    double e = (q.xx + r.xx) * x * x + (q.yy + r.yy) * y * y + (q.zz + r.zz) * z * z
+        + 2.0 * ((q.xy + r.xy) * x * y + (q.xz + r.xz) * x * z + (q.yz + r.yz) * y * z)
+        + 2.0 * ((q.dx + r.dx) * x + (q.dy + r.dy) * y + (q.dz + r.dz) * z)
+        + (q.dd + r.dd);
+    return e > 0.0 ? e : 0.0;
+}
+
+glm::vec3 vertexPosition(const float* positions, uint32_t v) {
+    return glm::vec3(positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]);
+}
+
+struct Collapse {
+    uint32_t from, to;
+    double cost;        // area-weighted, for ordering
+    double distance;    // root mean square distance to the merged planes
+};
+
+// Smallest cosine allowed between a triangle's normal before and after a collapse.
+const float MAX_NORMAL_CHANGE_COS = 0.2f;
+
+} // namespace
+
+std::vector<uint32_t> SimplifyMesh(const std::vector<uint32_t>& indices, size_t vertexCount, const float* positions,
+    size_t targetIndexCount, float maxError, float* error) {
+    std::vector<uint32_t> result(indices);
+    double maxDistance = 0.0;
+
+    // seams: vertices sharing a position with another vertex
+    std::vector<uint8_t> locked(vertexCount, 0);
+    std::vector<uint32_t> byPosition(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) byPosition[v] = (uint32_t)v;
+    auto positionLess = [&](uint32_t a, uint32_t b) {
+        return std::lexicographical_compare(positions + a * 3, positions + a * 3 + 3, positions + b * 3, positions + b * 3 + 3);
+    };
+    std::sort(byPosition.begin(), byPosition.end(), positionLess);
+    for (size_t i = 1; i < vertexCount; ++i) {
+        if (!positionLess(byPosition[i - 1], byPosition[i]))
+            locked[byPosition[i - 1]] = locked[byPosition[i]] = 1;
+    }
+
+    // open borders: edges used by a single triangle
+    std::vector<uint64_t> edges;
+    edges.reserve(result.size());
+    for (size_t i = 0; i < result.size(); i += 3) {
+        for (int k = 0; k < 3; ++k) {
+            uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+            edges.push_back(((uint64_t)std::min(a, b) << 32) | std::max(a, b));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();) {
+        size_t j = i;
+        while (j < edges.size() && edges[j] == edges[i]) ++j;
+        if (j - i == 1) locked[edges[i] >> 32] = locked[edges[i] & 0xffffffffu] = 1;
+        i = j;
+    }
+
+    std::vector<Quadric> quadrics(vertexCount, Quadric());
+    for (size_t i = 0; i < result.size(); i += 3) {
+        glm::vec3 p0 = vertexPosition(positions, result[i]);
+        glm::vec3 n = glm::cross(vertexPosition(positions, result[i + 1]) - p0, vertexPosition(positions, result[i + 2]) - p0);
+        float len = glm::length(n);
+        if (len <= 0.0f) continue;
+        glm::dvec3 unit(n / len);
+        for (int k = 0; k < 3; ++k) addPlane(quadrics[result[i + k]], unit, -glm::dot(unit, glm::dvec3(p0)), 0.5 * len);
+    }
+
+    // Each pass collapses the cheapest edges whose neighbourhoods do not overlap, so the
+    // flip test always sees up-to-date triangles; passes repeat until the target is met.
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> adjOffsets, adjTriangles, remap(vertexCount);
+    std::vector<uint8_t> touched(vertexCount);
+    while (result.size() > targetIndexCount) {
+        edges.clear();
+        for (size_t i = 0; i < result.size(); i += 3) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+                edges.push_back(((uint64_t)std::min(a, b) << 32) | std::max(a, b));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (uint64_t e : edges) {
+            uint32_t a = (uint32_t)(e >> 32), b = (uint32_t)(e & 0xffffffffu);
+            Collapse best = { a, b, -1.0, 0.0 };
+            if (!locked[a]) best.cost = quadricError(quadrics[a], quadrics[b], positions + b * 3);
+            if (!locked[b]) {
+                double cost = quadricError(quadrics[a], quadrics[b], positions + a * 3);
+                if (best.cost < 0.0 || cost < best.cost) best = { b, a, cost, 0.0 };
+            }
+            if (best.cost < 0.0) continue;
+            double weight = quadrics[a].w + quadrics[b].w;
+            best.distance = weight > 0.0 ? sqrt(best.cost / weight) : 0.0;
+            collapses.push_back(best);
+        }
+        if (collapses.empty()) break;
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+        adjOffsets.assign(vertexCount + 1, 0);
+        for (uint32_t v : result) ++adjOffsets[v + 1];
+        for (size_t v = 0; v < vertexCount; ++v) adjOffsets[v + 1] += adjOffsets[v];
+        adjTriangles.resize(result.size());
+        std::vector<uint32_t> fill(adjOffsets.begin(), adjOffsets.end() - 1);
+        for (size_t i = 0; i < result.size(); ++i) adjTriangles[fill[result[i]]++] = (uint32_t)(i / 3);
+
+        for (size_t v = 0; v < vertexCount; ++v) remap[v] = (uint32_t)v;
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t triangles = result.size() / 3, targetTriangles = targetIndexCount / 3;
+        size_t applied = 0;
+        for (const Collapse& c : collapses) {
+            if (triangles <= targetTriangles) break;
+            if (touched[c.from] || touched[c.to] || c.distance > maxError) continue;
+
+            // reject collapses that would turn a surviving triangle too far
+            bool flips = false;
+            size_t removed = 0;
+            glm::vec3 target = vertexPosition(positions, c.to);
+            for (uint32_t a = adjOffsets[c.from]; a < adjOffsets[c.from + 1] && !flips; ++a) {
+                const uint32_t* tri = &result[adjTriangles[a] * 3];
+                if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) { ++removed; continue; }
+                glm::vec3 p[3], q[3];
+                for (int k = 0; k < 3; ++k) {
+                    p[k] = vertexPosition(positions, tri[k]);
+                    q[k] = tri[k] == c.from ? target : p[k];
+                }
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+                flips = glm::dot(before, after) <= MAX_NORMAL_CHANGE_COS * glm::length(before) * glm::length(after);
+            }
+            if (flips) continue;
+
+            remap[c.from] = c.to;
+            addQuadric(quadrics[c.to], quadrics[c.from]);
+            maxDistance = std::max(maxDistance, c.distance);
+            triangles -= removed;
+            ++applied;
+            for (uint32_t a = adjOffsets[c.from]; a < adjOffsets[c.from + 1]; ++a)
+                for (int k = 0; k < 3; ++k) touched[result[adjTriangles[a] * 3 + k]] = 1;
+        }
+        if (applied == 0) break;
+
+        size_t out = 0;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            uint32_t a = remap[result[i]], b = remap[result[i + 1]], d = remap[result[i + 2]];
+            if (a == b || b == d || a == d) continue;
+            result[out++] = a;
+            result[out++] = b;
+            result[out++] = d;
+        }
+        result.resize(out);
+    }
+
+    if (error) *error = (float)maxDistance;
+    return result;
+}
+
+std::vector<uint32_t> OptimizeVertexFetch(std::vector<uint32_t>& indices, size_t vertexCount) {
+    const uint32_t unused = ~0u;
+    std::vector<uint32_t> remap(vertexCount, unused);
+    uint32_t next = 0;
+    for (uint32_t& v : indices) {
+        if (remap[v] == unused) remap[v] = next++;
+        v = remap[v];
+    }
+    for (size_t v = 0; v < vertexCount; ++v)
+        if (remap[v] == unused) remap[v] = next++;
+    return remap;
+}
+
+void RemapVertexAttribute(unsigned char* data, size_t vertexCount, size_t elementSize, size_t stride,
+    const std::vector<uint32_t>& remap) {
+    std::vector<unsigned char> copy(vertexCount * elementSize);
+    for (size_t v = 0; v < vertexCount; ++v)
+        memcpy(&copy[remap[v] * elementSize], data + v * stride, elementSize);
+    for (size_t v = 0; v < vertexCount; ++v)
+        memcpy(data + v * stride, &copy[v * elementSize], elementSize);
+}
@@ -0,0 +1,53 @@
+#ifndef _MESH_OPTIMIZE_H_
+#define _MESH_OPTIMIZE_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Load-time reordering of indexed triangle lists. None of it changes what is drawn,
+// only the order triangles and vertices are fed to the GPU.
+
+// Vertex cache efficiency under a FIFO cache of cacheSize entries: ACMR is transformed
+// vertices per triangle (0.5 is ideal for large grids, 3 the worst case), ATVR
+// transformed vertices per referenced vertex (1 is ideal).
+struct VertexCacheStats {
+    float acmr;
+    float atvr;
+};
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize = 16);
+
+// Reorders triangles for post-transform cache locality (Tipsify, Sander et al. 2007),
+// then groups the result into clusters that each keep their ACMR within overdrawThreshold
+// of the whole order, and draws the clusters facing most outward first (the view-
+// independent overdraw ordering of the same paper). positions holds xyz per vertex;
+// pass nullptr to skip the overdraw step.
+void OptimizeTriangleOrder(std::vector<uint32_t>& indices, size_t vertexCount, const float* positions,
+    unsigned cacheSize = 16, float overdrawThreshold = 1.05f);
+
+// Quadric error edge collapse (Garland & Heckbert 1997) down to about targetIndexCount
+// indices, skipping collapses that would move the surface further than maxError.
+// Vertices only ever collapse onto a neighbour, so the result indexes the same vertex
+// buffer. Vertices on open borders or on attribute seams (several vertices at one
+// position) stay put, so textures and outlines do not tear. error receives the largest
+// error of the collapses made, in position units.
+std::vector<uint32_t> SimplifyMesh(const std::vector<uint32_t>& indices, size_t vertexCount, const float* positions,
+    size_t targetIndexCount, float maxError, float* error = nullptr);
+
+// Renumbers vertices in the order the index buffer first uses them, rewriting indices.
+// Returns remap with remap[oldVertex] = newVertex; unreferenced vertices go last. Apply
+// it to every vertex attribute with RemapVertexAttribute.
+std::vector<uint32_t> OptimizeVertexFetch(std::vector<uint32_t>& indices, size_t vertexCount);
+
+// data holds vertexCount elements of elementSize bytes, stride bytes apart.
+void RemapVertexAttribute(unsigned char* data, size_t vertexCount, size_t elementSize, size_t stride,
+    const std::vector<uint32_t>& remap);
+
+template <typename T>
+void RemapVertexAttribute(std::vector<T>& values, size_t components, const std::vector<uint32_t>& remap) {
+    RemapVertexAttribute(reinterpret_cast<unsigned char*>(values.data()), values.size() / components,
+        components * sizeof(T), components * sizeof(T), remap);
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(size_t, size_t)>* job = nullptr;
+    size_t count = 0;
+    size_t chunk = 1;
+    std::atomic<size_t> next;
+    size_t busyWorkers = 0;
+    unsigned long generation = 0;
+    bool quit = false;
+
+    WorkerPool() : next(0) {
+        unsigned n = std::thread::hardware_concurrency();
+        n = (n > 1) ? n - 1 : 0;
+        for (unsigned i = 0; i < n; ++i)
+            threads.emplace_back([this] { workerLoop(); });
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads) t.join();
+    }
+
+    void runChunks() {
+        for (;;) {
+            size_t begin = next.fetch_add(chunk);
+            if (begin >= count) break;
+            (*job)(begin, std::min(begin + chunk, count));
+        }
+    }
+
+    void workerLoop() {
+        unsigned long seen = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            lock.unlock();
+
+            runChunks();
+
+            lock.lock();
+            if (--busyWorkers == 0) done.notify_one();
+        }
+    }
+
+    void run(size_t n, size_t minChunk, const std::function<void(size_t, size_t)>& fn) {
+        if (n == 0) return;
+        minChunk = std::max<size_t>(minChunk, 1);
+        if (threads.empty() || n <= minChunk) {
+            fn(0, n);
+            return;
+        }
+
+        // a few chunks per thread so uneven items still balance
+        size_t parts = (threads.size() + 1) * 4;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            count = n;
+            chunk = std::max(minChunk, (n + parts - 1) / parts);
+            next.store(0);
+            busyWorkers = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+
+        runChunks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return busyWorkers == 0; });
+        job = nullptr;
+    }
+};
+
+WorkerPool& pool() {
+    static WorkerPool instance;
+    return instance;
+}
+
+}
+
+void ParallelFor(size_t count, size_t minChunk, const std::function<void(size_t, size_t)>& fn) {
+    pool().run(count, minChunk, fn);
+}
+
+size_t ParallelWorkerCount() {
+    return pool().threads.size() + 1;
+}
@@ -0,0 +1,16 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <cstddef>
+#include <functional>
+
+// Splits [0, count) into chunks of at least minChunk items and runs fn(begin, end) on
+// them across a persistent pool of worker threads; the calling thread takes chunks
+// too and the call returns once every chunk is done. Small ranges run inline.
+// Not reentrant: fn must not call ParallelFor itself.
+void ParallelFor(size_t count, size_t minChunk, const std::function<void(size_t, size_t)>& fn);
+
+// Number of threads (workers + caller) that ParallelFor spreads work over.
+size_t ParallelWorkerCount();
+
+#endif
@@ -0,0 +1,48 @@
+#include "radix_sort.h"
+
+void RadixSortIndices(const uint32_t* keys, size_t count, std::vector<uint32_t>& order,
+    std::vector<uint64_t>& scratch) {
+    order.resize(count);
+    if (count < 2) {
+        if (count == 1) order[0] = 0;
+        return;
+    }
+
+    // Key in the high half and index in the low half, so each pass streams one array
+    // instead of gathering keys through the index.
+    scratch.resize(2 * count);
+    uint64_t* src = scratch.data();
+    uint64_t* dst = src + count;
+
+    size_t histogram[4][256] = {};
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t k = keys[i];
+        src[i] = ((uint64_t)k << 32) | (uint64_t)i;
+        ++histogram[0][k & 0xff];
+        ++histogram[1][(k >> 8) & 0xff];
+        ++histogram[2][(k >> 16) & 0xff];
+        ++histogram[3][k >> 24];
+    }
+
+    for (int pass = 0; pass < 4; ++pass) {
+        size_t* h = histogram[pass];
+        int shift = 32 + pass * 8;
+        if (h[(src[0] >> shift) & 0xff] == count) continue;
+
+        size_t offset = 0;
+        for (int d = 0; d < 256; ++d) {
+            size_t n = h[d];
+            h[d] = offset;
+            offset += n;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t v = src[i];
+            dst[h[(v >> shift) & 0xff]++] = v;
+        }
+        uint64_t* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    for (size_t i = 0; i < count; ++i) order[i] = (uint32_t)src[i];
+}
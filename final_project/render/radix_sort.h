@@ -0,0 +1,25 @@
+#ifndef _RADIX_SORT_H_
+#define _RADIX_SORT_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Maps a float to an unsigned key that sorts the same way: negative values get every
+// bit flipped, positive ones only the sign bit. Invert the key to sort descending.
+inline uint32_t FloatSortKey(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// LSD radix sort over 32-bit keys, eight bits per pass. Fills order with the indices
+// [0, count) by ascending key; equal keys keep their index order. Passes whose digit
+// is the same for every key are skipped, which for depths within a few orders of
+// magnitude leaves two or three. scratch is kept between calls so that sorting the
+// same number of keys again does not allocate.
+void RadixSortIndices(const uint32_t* keys, size_t count, std::vector<uint32_t>& order,
+    std::vector<uint64_t>& scratch);
+
+#endif
@@ -0,0 +1,116 @@
+#include "render_queue.h"
+
+#include <algorithm>
+
+void GLStateCache::useProgram(GLuint p) {
+    if (p == program) { ++counters.skipped; return; }
+    program = p;
+    ++counters.programBinds;
+    glUseProgram(p);
+}
+
+void GLStateCache::bindVertexArray(GLuint v) {
+    if (v == vao) { ++counters.skipped; return; }
+    vao = v;
+    ++counters.vertexArrayBinds;
+    glBindVertexArray(v);
+}
+
+void GLStateCache::bindTexture(int unit, GLuint texture) {
+    if (unit < 0 || unit >= TEXTURE_UNITS) return;
+    if (textures[unit] == texture) { ++counters.skipped; return; }
+    textures[unit] = texture;
+    ++counters.textureBinds;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void GLStateCache::setBlend(BlendMode mode) {
+    if (blend == (int)mode) { ++counters.skipped; return; }
+    ++counters.stateChanges;
+    if (mode == BLEND_NONE) {
+        glDisable(GL_BLEND);
+    }
+    else {
+        if (blend == (int)BLEND_NONE || blend < 0) glEnable(GL_BLEND);
+        if (mode == BLEND_ALPHA) glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        else if (mode == BLEND_WEIGHTED_OIT) glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+        else glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    blend = (int)mode;
+}
+
+void GLStateCache::setCullFace(bool enabled) {
+    if (cullFace == (int)enabled) { ++counters.skipped; return; }
+    cullFace = (int)enabled;
+    ++counters.stateChanges;
+    if (enabled) glEnable(GL_CULL_FACE);
+    else glDisable(GL_CULL_FACE);
+}
+
+void GLStateCache::setDepthMask(bool enabled) {
+    if (depthMask == (int)enabled) { ++counters.skipped; return; }
+    depthMask = (int)enabled;
+    ++counters.stateChanges;
+    glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+}
+
+void GLStateCache::invalidate() {
+    program = UNKNOWN;
+    vao = UNKNOWN;
+    for (int i = 0; i < TEXTURE_UNITS; ++i) textures[i] = UNKNOWN;
+    blend = -1;
+    cullFace = -1;
+    depthMask = -1;
+}
+
+uint64_t MakeDrawKey(unsigned pass, BlendMode blend, GLuint program, GLuint vao, GLuint texture, float depth) {
+    const uint64_t DEPTH_MAX = (1u << 27) - 1;
+    double d = depth < 0.0f ? 0.0 : (depth > 1.0f ? 1.0 : (double)depth);
+    uint64_t qd = (uint64_t)(d * DEPTH_MAX);     // in double: DEPTH_MAX does not fit a float
+
+    uint64_t key = (uint64_t)(pass & 0xf) << 60;
+    if (blend == BLEND_NONE) {
+        key |= (uint64_t)(program & 0x3ff) << 49;
+        key |= (uint64_t)(vao & 0x3ff) << 39;
+        key |= (uint64_t)(texture & 0xfff) << 27;
+        key |= qd;
+    }
+    else {
+        key |= (uint64_t)1 << 59;
+        key |= (DEPTH_MAX - qd) << 32;
+        key |= (uint64_t)(blend & 0x3) << 30;
+        key |= (uint64_t)(program & 0x3ff) << 20;
+        key |= (uint64_t)(vao & 0x3ff) << 10;
+        key |= (uint64_t)(texture & 0x3ff);
+    }
+    return key;
+}
+
+void RenderQueue::sort() {
+    std::stable_sort(packets.begin(), packets.end(),
+        [](const DrawPacket& a, const DrawPacket& b) { return a.key < b.key; });
+}
+
+size_t RenderQueue::firstBlended() const {
+    return std::find_if(packets.begin(), packets.end(),
+        [](const DrawPacket& p) { return p.blend != BLEND_NONE; }) - packets.begin();
+}
+
+void RenderQueue::submit(GLStateCache& gl, size_t begin, size_t end) const {
+    for (size_t i = begin; i < end && i < packets.size(); ++i) {
+        const DrawPacket& p = packets[i];
+        gl.useProgram(p.program);
+        if (p.vao) gl.bindVertexArray(p.vao);
+        if (p.texture) gl.bindTexture(0, p.texture);
+        gl.setBlend(p.blend);
+        gl.setCullFace(p.cullFace);
+        gl.setDepthMask(p.depthMask);
+        p.draw(gl, p.context, p.item);
+    }
+    gl.bindVertexArray(0);
+    gl.setBlend(BLEND_NONE);
+    gl.setCullFace(true);
+    gl.setDepthMask(true);
+}
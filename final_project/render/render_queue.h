@@ -0,0 +1,102 @@
+#ifndef _RENDER_QUEUE_H_
+#define _RENDER_QUEUE_H_
+
+#include <glad/gl.h>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+enum BlendMode {
+    BLEND_NONE,
+    BLEND_ALPHA,            // src * a + dst * (1 - a)
+    BLEND_PREMULTIPLIED,    // src + dst * (1 - a)
+    BLEND_WEIGHTED_OIT,     // color src + dst, alpha dst * (1 - a): weighted blended OIT targets
+};
+
+// Shadows the GL state that draws change most often and only forwards changes.
+// Everything that binds programs, vertex arrays or 2D textures, or toggles blending,
+// face culling or depth writes between frames' draws must go through it; call
+// invalidate() after code that did not.
+class GLStateCache {
+public:
+    static const int TEXTURE_UNITS = 16;
+
+    struct Stats {
+        unsigned programBinds = 0;
+        unsigned vertexArrayBinds = 0;
+        unsigned textureBinds = 0;
+        unsigned stateChanges = 0;      // blend, cull and depth mask
+        unsigned skipped = 0;           // calls that matched the current state
+    };
+
+    GLStateCache() { invalidate(); }
+
+    void useProgram(GLuint program);
+    void bindVertexArray(GLuint vao);
+    void bindTexture(int unit, GLuint texture);    // GL_TEXTURE_2D
+    void setBlend(BlendMode mode);
+    void setCullFace(bool enabled);
+    void setDepthMask(bool enabled);
+
+    // Forgets everything, so the next call of each kind goes to GL.
+    void invalidate();
+
+    const Stats& stats() const { return counters; }
+    void resetStats() { counters = Stats(); }
+
+private:
+    // UNKNOWN never matches a real value
+    static const GLuint UNKNOWN = ~0u;
+
+    GLuint program;
+    GLuint vao;
+    GLuint textures[TEXTURE_UNITS];
+    int blend;
+    int cullFace;
+    int depthMask;
+    Stats counters;
+};
+
+// One draw: the state it needs and a function that issues it (uniforms and the draw
+// call). draw is called with the state already applied and must not change it other
+// than through the cache it is given.
+struct DrawPacket {
+    uint64_t key;
+    GLuint program;
+    GLuint vao;             // 0 leaves the binding to draw
+    GLuint texture;         // bound to unit 0 when not 0
+    BlendMode blend;
+    bool cullFace;
+    bool depthMask;
+    void (*draw)(GLStateCache& gl, void* context, uint32_t item);
+    void* context;
+    uint32_t item;
+};
+
+// Sort key, most significant first: pass (4 bits), then for opaque packets program,
+// vertex array, texture and depth front to back; for blended packets depth back to
+// front, then blend mode, program, vertex array and texture. Names are truncated to
+// their field, which only affects grouping. depth is in [0, 1].
+uint64_t MakeDrawKey(unsigned pass, BlendMode blend, GLuint program, GLuint vao, GLuint texture, float depth);
+
+// Packets collected for a pass, sorted by key and submitted through a GLStateCache.
+// Packets with equal keys keep the order they were pushed in.
+class RenderQueue {
+public:
+    void clear() { packets.clear(); }
+    void push(const DrawPacket& packet) { packets.push_back(packet); }
+    size_t size() const { return packets.size(); }
+
+    void sort();
+    // Index of the first packet that blends, once sorted; size() if none does.
+    size_t firstBlended() const;
+    // Submits the packets in [begin, end) in order, then binds vertex array 0 and
+    // restores the default state (no blending, face culling and depth writes on).
+    void submit(GLStateCache& gl, size_t begin, size_t end) const;
+    void submit(GLStateCache& gl) const { submit(gl, 0, packets.size()); }
+
+private:
+    std::vector<DrawPacket> packets;
+};
+
+#endif
@@ -6,7 +6,17 @@
 #include <sstream> 
 #include <vector>
 
-GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path)
+void InsertAfterVersion(std::string &code, const char *header)
+{
+	size_t version = code.find("#version");
+	size_t line = (version == std::string::npos) ? std::string::npos : code.find('\n', version);
+	if (line == std::string::npos)
+		code.insert(0, header);
+	else
+		code.insert(line + 1, header);
+}
+
+GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path, const char *header)
 {
 	// Create the shaders
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
@@ -44,6 +54,12 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 		return 0;
 	}
 
+	if (header)
+	{
+		InsertAfterVersion(VertexShaderCode, header);
+		InsertAfterVersion(FragmentShaderCode, header);
+	}
+
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
@@ -4,8 +4,13 @@
 #include <glad/gl.h>
 #include <string>
 
-GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path);
+// header, if given, is inserted after the #version line of both stages (declarations
+// shared by every program, such as a uniform block).
+GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path, const char *header = NULL);
 
 GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode);
 
+// Inserts header after the #version line of code, or at its start if it has none.
+void InsertAfterVersion(std::string &code, const char *header);
+
 #endif
@@ -6,15 +6,16 @@ in vec4 vLightSpacePos;
 
 out vec3 finalColor;
 
-uniform vec3 lightPosition;
-uniform vec3 lightIntensity;
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
 
-uniform sampler2D uShadowMap;
+uniform sampler2D uShadowMap;    // static casters (clouds)
+uniform sampler2D uShadowMapDyn; // animated casters (bots), same light matrix
 
-uniform vec3 cameraPosition;
-uniform vec3 fogColor;
-uniform float fogStart;
-uniform float fogEnd;
+// cascades, used when uShadowMode is 1
+uniform sampler2D uCascadeMap0;
+uniform sampler2D uCascadeMap1;
+uniform sampler2D uCascadeMap2;
+uniform sampler2D uCascadeMap3;
 
 float shadowFactor(vec4 lightSpacePos, vec3 N, vec3 L) {
     vec3 ndc = lightSpacePos.xyz / lightSpacePos.w;
@@ -23,13 +24,42 @@ float shadowFactor(vec4 lightSpacePos, vec3 N, vec3 L) {
     if (sc.x < 0.0 || sc.x > 1.0 || sc.y < 0.0 || sc.y > 1.0 || sc.z < 0.0 || sc.z > 1.0)
         return 1.0;
 
-    float closest = texture(uShadowMap, sc.xy).r;
+    float closest = min(texture(uShadowMap, sc.xy).r, texture(uShadowMapDyn, sc.xy).r);
     float current = sc.z;
 
     float bias = max(0.0018 * (1.0 - dot(N, L)), 0.0006);
     return (current - bias > closest) ? 0.35 : 1.0;
 }
 
+float sampleCascade(int i, vec2 uv) {
+    if (i == 0) return texture(uCascadeMap0, uv).r;
+    if (i == 1) return texture(uCascadeMap1, uv).r;
+    if (i == 2) return texture(uCascadeMap2, uv).r;
+    return texture(uCascadeMap3, uv).r;
+}
+
+float cascadedShadowFactor(vec3 N, vec3 L) {
+    float viewDepth = dot(worldPosition - cameraPosition, uViewForward);
+
+    int cascade = uCascadeCount;
+    for (int i = 0; i < uCascadeCount; ++i) {
+        if (viewDepth <= uCascadeSplits[i]) { cascade = i; break; }
+    }
+    if (cascade >= uCascadeCount) return 1.0;
+
+    vec4 lightSpacePos = uCascadeVP[cascade] * vec4(worldPosition, 1.0);
+    vec3 sc = lightSpacePos.xyz / lightSpacePos.w * 0.5 + 0.5;
+    if (sc.x < 0.0 || sc.x > 1.0 || sc.y < 0.0 || sc.y > 1.0 || sc.z < 0.0 || sc.z > 1.0)
+        return 1.0;
+
+    // uCascadeBias is one texel in depth units; grazing light spans more texels in depth
+    float closest = sampleCascade(cascade, sc.xy);
+    float NdotL = clamp(dot(N, L), 0.05, 1.0);
+    float slope = min(sqrt(1.0 - NdotL * NdotL) / NdotL, 4.0);
+    float bias = uCascadeBias[cascade] * (1.0 + slope);
+    return (sc.z - bias > closest) ? 0.35 : 1.0;
+}
+
 void main() {
     vec3 N = normalize(worldNormal);
     vec3 Lvec = lightPosition - worldPosition;
@@ -47,7 +77,7 @@ void main() {
     vec3 diffuse  = NdotL * (lightIntensity / dist2);
     vec3 specular = spec * (lightIntensity / dist2) * 0.35;
 
-    float sh = shadowFactor(vLightSpacePos, N, L);
+    float sh = (uShadowMode == 1) ? cascadedShadowFactor(N, L) : shadowFactor(vLightSpacePos, N, L);
 
     vec3 v = (diffuse + specular) * sh;
 
@@ -5,33 +5,74 @@ layout(location = 1) in vec3 vertexNormal;
 layout(location = 2) in vec2 vertexUV;
 layout(location = 3) in vec4 vertexJointsFloat;
 layout(location = 4) in vec4 vertexWeights;
+layout(location = 5) in mat4 iModel;       // per-instance, occupies locations 5..8
+layout(location = 9) in int iPaletteBase;  // per-instance, first matrix of its palette
+layout(location = 10) in float iAnimTime;  // per-instance, used by the baked animation
 
 out vec3 worldPosition;
 out vec3 worldNormal;
 out vec4 vLightSpacePos;
 
-uniform mat4 MVP;       
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
+
 uniform mat4 uModel;    
-uniform mat4 uLightVP;   
 uniform mat4 jointMatrices[100];
+uniform bool uPreSkinned; // vertices already skinned into a static buffer this frame
+
+uniform bool uInstanced;  // model matrix and palette come from the instance attributes
+uniform samplerBuffer uPalettes;
+
+// baked animation: row = frame, three texels per joint holding the rows of its 3x4 matrix
+uniform bool uBaked;
+uniform sampler2D uBakedPalettes;
+uniform int uBakedFrameCount;
+uniform float uBakedFPS;
+
+int bakedFrame0, bakedFrame1;
+float bakedAlpha;
+
+mat4 bakedJoint(int frame, uint j) {
+    int x = int(j) * 3;
+    return transpose(mat4(texelFetch(uBakedPalettes, ivec2(x, frame), 0),
+        texelFetch(uBakedPalettes, ivec2(x + 1, frame), 0),
+        texelFetch(uBakedPalettes, ivec2(x + 2, frame), 0),
+        vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
+mat4 jointMatrix(uint j) {
+    if (uBaked) return mix(bakedJoint(bakedFrame0, j), bakedJoint(bakedFrame1, j), bakedAlpha);
+    if (!uInstanced) return jointMatrices[j];
+    int base = (iPaletteBase + int(j)) * 4;
+    return mat4(texelFetch(uPalettes, base), texelFetch(uPalettes, base + 1),
+        texelFetch(uPalettes, base + 2), texelFetch(uPalettes, base + 3));
+}
 
 void main() {
+    if (uBaked) {
+        float frame = mod(iAnimTime * uBakedFPS, float(uBakedFrameCount));
+        bakedFrame0 = int(frame);
+        bakedFrame1 = (bakedFrame0 + 1) % uBakedFrameCount;
+        bakedAlpha = fract(frame);
+    }
+
     uvec4 j = uvec4(vertexJointsFloat);
 
-    mat4 skinMat =
-        vertexWeights.x * jointMatrices[j.x] +
-        vertexWeights.y * jointMatrices[j.y] +
-        vertexWeights.z * jointMatrices[j.z] +
-        vertexWeights.w * jointMatrices[j.w];
+    mat4 skinMat = uPreSkinned ? mat4(1.0) :
+        vertexWeights.x * jointMatrix(j.x) +
+        vertexWeights.y * jointMatrix(j.y) +
+        vertexWeights.z * jointMatrix(j.z) +
+        vertexWeights.w * jointMatrix(j.w);
+
+    mat4 model = uInstanced ? iModel : uModel;
 
     vec4 skinnedLocal = skinMat * vec4(vertexPosition, 1.0);
-    vec4 wp = uModel * skinnedLocal;
+    vec4 wp = model * skinnedLocal;
 
-    gl_Position = MVP * skinnedLocal;
+    gl_Position = uViewProj * wp;
 
     worldPosition = wp.xyz;
 
-    mat3 M = mat3(uModel) * mat3(skinMat);
+    mat3 M = mat3(model) * mat3(skinMat);
     worldNormal = normalize(M * vertexNormal);
 
     vLightSpacePos = uLightVP * wp;
@@ -4,12 +4,16 @@ in vec3 worldPosition;
 
 uniform sampler2D ucolor;
 
-uniform vec3 cameraPosition;
-uniform vec3 fogColor;
-uniform float fogStart;
-uniform float fogEnd;
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
 
-out vec4 FragColor;
+layout(location = 0) out vec4 FragColor;   // OIT: premultiplied color * weight, alpha
+layout(location = 1) out float FragWeight; // OIT: alpha * weight
+
+// Nearer layers weigh more; distance is measured against the fog end, and the range is
+// kept small enough for a half-float target to hold a few dozen layers.
+float oitWeight(float a, float dist) {
+    return a * clamp(0.03 / (1e-5 + pow(dist / fogEnd, 4.0)), 1e-2, 3e2);
+}
 
 void main() {
     vec4 c = texture(ucolor, vUV);
@@ -20,5 +24,11 @@ void main() {
     float fogFactor = clamp((dist - fogStart) / (fogEnd - fogStart), 0.0, 1.0);
 
     vec3 rgb = mix(c.rgb, fogColor, fogFactor);
+    if (uWeightedOIT) {
+        float w = oitWeight(a, dist);
+        FragColor = vec4(rgb * a * w, a);
+        FragWeight = a * w;
+        return;
+    }
     FragColor = vec4(rgb, a);
 }
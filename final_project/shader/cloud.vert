@@ -2,7 +2,8 @@
 layout(location=0) in vec3 aPos;
 layout(location=1) in vec2 aUV;
 
-uniform mat4 uMVP;
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
+
 uniform mat4 uModel;
 
 out vec2 vUV;
@@ -12,5 +13,5 @@ void main() {
     vUV = aUV;
     vec4 wp = uModel * vec4(aPos, 1.0);
     worldPosition = wp.xyz;
-    gl_Position = uMVP * vec4(aPos, 1.0);
+    gl_Position = uViewProj * wp;
 }
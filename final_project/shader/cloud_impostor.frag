@@ -0,0 +1,86 @@
+#version 330 core
+in vec3 vToEye;
+in vec3 vQuad;
+in vec3 worldPosition;
+flat in vec3 vToEyeWorld;
+flat in float vRadius;
+
+uniform sampler2D uImpostorColor;   // premultiplied color and alpha
+uniform sampler2D uImpostorDepth;   // 0..1 across [-radius, radius] behind the center plane
+uniform int uImpostorFrames;        // views per atlas side
+
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
+
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out float FragWeight;
+
+// same weight as cloud.frag
+float oitWeight(float a, float dist) {
+    return a * clamp(0.03 / (1e-5 + pow(dist / fogEnd, 4.0)), 1e-2, 3e2);
+}
+
+void impostorBasis(vec3 d, out vec3 right, out vec3 up) {
+    up = abs(d.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    right = normalize(cross(up, d));
+    up = cross(d, right);
+}
+
+vec2 octahedralEncode(vec3 d) {
+    d /= abs(d.x) + abs(d.y) + abs(d.z);
+    vec2 e = d.xz;
+    if (d.y < 0.0) e = (1.0 - abs(d.zx)) * vec2(d.x >= 0.0 ? 1.0 : -1.0, d.z >= 0.0 ? 1.0 : -1.0);
+    return e * 0.5 + 0.5;
+}
+
+vec3 octahedralDecode(vec2 uv) {
+    vec2 e = uv * 2.0 - 1.0;
+    vec3 d = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+    if (d.y < 0.0) d.xz = (1.0 - abs(d.zx)) * vec2(d.x >= 0.0 ? 1.0 : -1.0, d.z >= 0.0 ? 1.0 : -1.0);
+    return normalize(d);
+}
+
+void main() {
+    // blend the four baked views around the view direction, each one sampled where the
+    // quad point projects onto that view's image plane
+    float frames = float(uImpostorFrames);
+    vec2 grid = octahedralEncode(normalize(vToEye)) * frames - 0.5;
+    vec2 cell0 = floor(grid);
+    vec2 f = grid - cell0;
+
+    vec4 color = vec4(0.0);
+    float depth = 0.0, depthWeight = 0.0;
+    for (int i = 0; i < 4; ++i) {
+        vec2 offset = vec2(i & 1, i >> 1);
+        vec2 cell = clamp(cell0 + offset, 0.0, frames - 1.0);
+        float w = (offset.x > 0.0 ? f.x : 1.0 - f.x) * (offset.y > 0.0 ? f.y : 1.0 - f.y);
+
+        vec3 right, up;
+        impostorBasis(octahedralDecode((cell + 0.5) / frames), right, up);
+        vec2 uv = vec2(dot(vQuad, right), dot(vQuad, up)) * 0.5 + 0.5;
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) continue;
+
+        vec2 atlasUV = (cell + uv) / frames;
+        vec4 c = texture(uImpostorColor, atlasUV);
+        color += c * w;
+        if (c.a > 0.05) {
+            depth += texture(uImpostorDepth, atlasUV).r * w;
+            depthWeight += w;
+        }
+    }
+    if (color.a < 0.05 || depthWeight <= 0.0) discard;
+
+    vec3 p = worldPosition - vToEyeWorld * ((depth / depthWeight) * 2.0 - 1.0) * vRadius;
+    vec4 clip = uViewProj * vec4(p, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    float dist = distance(cameraPosition, p);
+    float fogFactor = clamp((dist - fogStart) / (fogEnd - fogStart), 0.0, 1.0);
+    vec3 rgb = mix(color.rgb, fogColor * color.a, fogFactor);
+    if (uWeightedOIT) {
+        float w = oitWeight(color.a, dist);
+        FragColor = vec4(rgb * w, color.a);
+        FragWeight = color.a * w;
+        return;
+    }
+    FragColor = vec4(rgb, color.a);
+}
@@ -0,0 +1,41 @@
+#version 330 core
+// Camera-facing quad per distant cloud tile, four vertices from gl_VertexID.
+layout(location=0) in vec4 iCenterRadius; // per-instance: world bound sphere
+layout(location=1) in float iRotY;        // per-instance: the tile's yaw
+
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
+
+out vec3 vToEye;        // cloud space, toward the camera
+out vec3 vQuad;         // cloud space, point on the quad in units of the radius
+out vec3 worldPosition;
+flat out vec3 vToEyeWorld;
+flat out float vRadius;
+
+// Same frame basis as the atlas was baked with.
+void impostorBasis(vec3 d, out vec3 right, out vec3 up) {
+    up = abs(d.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    right = normalize(cross(up, d));
+    up = cross(d, right);
+}
+
+vec3 worldToCloud(vec3 v, float c, float s) {
+    return vec3(c * v.x - s * v.z, v.y, s * v.x + c * v.z);
+}
+
+void main() {
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, (gl_VertexID & 2) == 0 ? -1.0 : 1.0);
+    vec3 toEye = normalize(cameraPosition - iCenterRadius.xyz);
+    vec3 right, up;
+    impostorBasis(toEye, right, up);
+    vec3 offset = right * corner.x + up * corner.y;
+
+    float c = cos(iRotY), s = sin(iRotY);
+    vToEye = worldToCloud(toEye, c, s);
+    vQuad = worldToCloud(offset, c, s);
+    vToEyeWorld = toEye;
+    vRadius = iCenterRadius.w;
+
+    vec4 wp = vec4(iCenterRadius.xyz + offset * iCenterRadius.w, 1.0);
+    worldPosition = wp.xyz;
+    gl_Position = uViewProj * wp;
+}
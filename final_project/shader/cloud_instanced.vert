@@ -0,0 +1,16 @@
+#version 330 core
+layout(location=0) in vec3 aPos;
+layout(location=1) in vec2 aUV;
+layout(location=3) in mat4 iModel; // per-instance, occupies locations 3..6
+
+// Per-frame constants: the FrameUniforms block is inserted by the loader (FRAME_UNIFORMS_GLSL)
+
+out vec2 vUV;
+out vec3 worldPosition;
+
+void main() {
+    vUV = aUV;
+    vec4 wp = iModel * vec4(aPos, 1.0);
+    worldPosition = wp.xyz;
+    gl_Position = uViewProj * wp;
+}